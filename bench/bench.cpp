@@ -0,0 +1,198 @@
+#include "../include/expression.hpp"
+#include "../include/static_expression.hpp"
+#include "../include/stats.hpp"
+#include "../include/thread_pool.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using Expr = Expression<double>;
+using Clock = std::chrono::steady_clock;
+
+// Keeps computed values observable so the loops are not optimized away
+volatile double sink;
+
+// Times `ops` calls of op() after one warm-up call and prints one report
+// row. `shape`, if given, is the expression whose size is reported
+template <typename F>
+void bench(const std::string &name, size_t ops, F op,
+           const Expr *shape = nullptr) {
+    op();
+
+    stats::Allocations before{stats::allocations()};
+    Clock::time_point start{Clock::now()};
+
+    for (size_t i = 0; i < ops; ++i) op();
+
+    Clock::time_point end{Clock::now()};
+    stats::Allocations after{stats::allocations()};
+
+    double ns{std::chrono::duration<double, std::nano>(end - start).count()};
+
+    std::cout << std::left << std::setw(34) << name << std::right
+              << std::setw(10) << ops << std::setw(14) << std::fixed
+              << std::setprecision(1) << ns / ops;
+
+    if (shape)
+        std::cout << std::setw(12) << shape->nodeCount() << std::setw(10)
+                  << shape->uniqueNodeCount();
+    else std::cout << std::setw(12) << "-" << std::setw(10) << "-";
+
+    std::cout << std::setw(12) << std::setprecision(2)
+              << double(after.count - before.count) / ops << std::setw(14)
+              << double(after.bytes - before.bytes) / ops << "\n";
+}
+
+// ((((x + 1) * 2 + 1) * 2 ...) with a function call every few levels
+std::string deepExpression(int depth) {
+    std::string expr{"x"};
+
+    for (int level = 0; level < depth; ++level) {
+        if (level % 8 == 7) expr = "sin(" + expr + ")";
+        else if (level % 2) expr = "(" + expr + ") * 2";
+        else expr = "(" + expr + ") + 1";
+    }
+
+    return expr;
+}
+
+// c1 * va ^ p1 + c2 * vb ^ p2 + ... over a few variables, so like terms collect
+std::string wideSum(int terms, int variables) {
+    std::string expr;
+
+    for (int term = 0; term < terms; ++term) {
+        if (term) expr += " + ";
+        // Variable names are letters only: va, vb, ..., vz, wa, ...
+        int variable{term % variables};
+        expr += std::to_string(term % 7 + 1) + " * " +
+                char('v' + variable / 26) + char('a' + variable % 26) + " ^ " +
+                std::to_string(term % 3 + 1);
+    }
+
+    return expr;
+}
+
+int main(int argc, char *argv[]) {
+    // Scales every workload, e.g. 0.1 for a quick run
+    double scale{argc > 1 ? std::atof(argv[1]) : 1.0};
+    auto ops = [scale](size_t base) {
+        size_t scaled{static_cast<size_t>(base * scale)};
+        return scaled ? scaled : size_t{1};
+    };
+
+    std::cout << std::left << std::setw(34) << "benchmark" << std::right
+              << std::setw(10) << "ops" << std::setw(14) << "ns/op"
+              << std::setw(12) << "nodes" << std::setw(10) << "unique"
+              << std::setw(12) << "allocs/op" << std::setw(14) << "bytes/op"
+              << "\n";
+
+    // Every operation builds into a fresh pool, as a new input would
+    Expr result;
+
+    std::string deep{deepExpression(2000)};
+    bench("parse deep", ops(200), [&]() {
+        ExpressionPool<double>::Scope scope;
+        result = Expr::fromString(deep);
+    }, &result);
+
+    bench("parse + derivative deep", ops(200), [&]() {
+        ExpressionPool<double>::Scope scope;
+        result = Expr::fromString(deep).derivative("x");
+    }, &result);
+
+    bench("... + simplify", ops(20), [&]() {
+        ExpressionPool<double>::Scope scope;
+        result = Expr::fromString(deep).derivative("x").simplify();
+    }, &result);
+
+    std::string wide{wideSum(2000, 50)};
+    bench("parse wide sum", ops(200), [&]() {
+        ExpressionPool<double>::Scope scope;
+        result = Expr::fromString(wide);
+    }, &result);
+
+    bench("parse + simplify wide sum", ops(50), [&]() {
+        ExpressionPool<double>::Scope scope;
+        result = Expr::fromString(wide).simplify();
+    }, &result);
+
+    for (const char *exprString : {"ln(x) / cos(x)", "(x ^ x) ^ (x ^ x)"}) {
+        bench(std::string("4th derivative ") + exprString, ops(50), [&]() {
+            ExpressionPool<double>::Scope scope;
+            result = Expr::fromString(exprString);
+
+            for (int order = 0; order < 4; ++order)
+                result = result.derivative("x").simplify();
+        }, &result);
+    }
+
+    Expr evaluated{Expr::fromString("x * sin(y) + ln(x) / y - exp(x * y)")};
+    std::map<std::string, double> context{{"x", 1.5}, {"y", 0.5}};
+
+    bench("evaluate tree", ops(1000000), [&]() {
+        context["x"] += 1e-9;
+        sink = evaluated.evaluate(context);
+    }, &evaluated);
+
+    CompiledExpression<double> program{evaluated.compile({"x", "y"})};
+    std::vector<double> values{1.5, 0.5}, partials;
+
+    bench("evaluate tape", ops(10000000), [&]() {
+        values[0] += 1e-9;
+        sink = program.evaluate(values);
+    }, &evaluated);
+
+    bench("gradient tape", ops(5000000), [&]() {
+        values[0] += 1e-9;
+        sink = program.gradient(values, partials);
+    }, &evaluated);
+
+    // The same formula fixed at compile time
+    constexpr static_expr::Variable<0> x{};
+    constexpr static_expr::Variable<1> y{};
+    auto fixed = x * static_expr::sin(y) + static_expr::ln(x) / y -
+                 static_expr::exp(x * y);
+    auto fixedDerivative = static_expr::derivative(fixed, x);
+
+    bench("evaluate static", ops(10000000), [&]() {
+        values[0] += 1e-9;
+        sink = fixed.evaluate(values.data());
+    }, &evaluated);
+
+    bench("evaluate static d/dx", ops(10000000), [&]() {
+        values[0] += 1e-9;
+        sink = fixedDerivative.evaluate(values.data());
+    });
+
+    // One op is a whole batch, ns/op divided by rows gives ns per row
+    size_t rows{1000000};
+    std::vector<double> xs(rows), ys(rows), out(rows);
+    std::vector<std::uint8_t> errors(rows);
+
+    for (size_t row = 0; row < rows; ++row) {
+        xs[row] = 1.0 + row * 1e-6;
+        ys[row] = 0.5 + row * 1e-7;
+    }
+
+    std::map<std::string, const double *> columns{{"x", xs.data()},
+                                                  {"y", ys.data()}};
+
+    bench("evaluate batch 1M rows", ops(20), [&]() {
+        evaluated.evaluateBatch(columns, rows, out.data(), errors.data());
+        sink = out[rows / 2];
+    }, &evaluated);
+
+    // Allocations are counted per thread, the workers' are not included
+    ThreadPool pool;
+    bench("evaluate batch 1M threaded", ops(20), [&]() {
+        evaluated.evaluateBatch(columns, rows, out.data(), errors.data(),
+                                &pool);
+        sink = out[rows / 2];
+    }, &evaluated);
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#ifndef COMPILED_HPP
+#define COMPILED_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Forward declarations
+template <typename T> class Expression;
+class ThreadPool;
+
+enum class OpCode : std::uint8_t {
+  Constant,
+  Load,
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Pow,
+  Neg,
+  Sin,
+  Cos,
+  Ln,
+  Exp,
+};
+
+struct Instruction {
+  OpCode op;
+  std::uint32_t arg; // Constant index for Constant, slot index for Load
+  // Registers holding the result and the operands
+  std::uint32_t target {0}, left {0}, right {0};
+
+  Instruction(OpCode op, std::uint32_t arg) : op {op}, arg {arg} {}
+};
+
+// Flat tape produced by Expression<T>::compile(). Every distinct node of the
+// DAG becomes one instruction, which reads its operands from and writes its
+// result to registers, so shared subexpressions are computed once. Variables
+// are resolved to integer slots once, so evaluation is a single loop over the
+// tape with no recursion, allocation or map lookups.
+template <typename T> class CompiledExpression {
+public:
+  CompiledExpression() = default;
+
+  // `slots` holds one value per variable (see variables()), `registers`
+  // must have room for at least registerCount() values
+  T evaluate(const T *slots, T *registers) const;
+
+  // Uses internal registers, so a single instance is not safe to evaluate
+  // from several threads at once
+  T evaluate(const std::vector<T> &slots) const;
+  T evaluate(const std::map<std::string, T> &context) const;
+
+  // Columnar evaluation: `columns[slot]` points at `rows` values of that
+  // variable. Rows are processed in blocks of BatchBlock, optionally spread
+  // over `pool`. Rows hitting a domain error get errors[row] = 1 and a NaN
+  // result instead of aborting the batch. Returns the number of such rows
+  std::size_t evaluateBatch(const T *const *columns, std::size_t rows,
+                            T *result, std::uint8_t *errors,
+                            ThreadPool *pool = nullptr) const;
+
+  static const std::size_t BatchBlock {256};
+
+  // Reverse-mode differentiation: one forward sweep storing every
+  // intermediate value, then one adjoint sweep back over the tape. Writes
+  // d(result)/d(slot) into `partials` and returns the value. `values` and
+  // `adjoints` need room for size() entries each
+  T gradient(const T *slots, T *partials, T *values, T *adjoints) const;
+
+  // Uses internal buffers, same thread-safety caveat as evaluate()
+  T gradient(const std::vector<T> &slots, std::vector<T> &partials) const;
+
+  std::size_t slotCount() const;
+  std::size_t registerCount() const;
+  std::size_t size() const;
+
+  // Returns slotCount() if the variable does not occur in the expression
+  std::size_t slotOf(const std::string &var) const;
+  const std::vector<std::string> &variables() const;
+
+private:
+  friend class Expression<T>;
+
+  std::uint32_t addSlot(const std::string &var);
+  // Each returns the tape position of the new instruction, operands are
+  // given by theirs
+  std::uint32_t emitConstant(T val);
+  std::uint32_t emitLoad(std::uint32_t slot);
+  std::uint32_t emit(OpCode op, std::uint32_t left, std::uint32_t right = 0);
+  std::uint32_t push(const Instruction &instruction, std::uint32_t left,
+                     std::uint32_t right);
+  // Marks the instruction at `result` as the value of the tape and assigns
+  // registers, reusing those of values no later instruction reads
+  void finish(std::uint32_t result);
+
+  static std::size_t operandCount(OpCode op);
+
+  void evaluateBlock(const T *const *columns, std::size_t begin,
+                     std::size_t count, T *result, std::uint8_t *errors,
+                     T *registers) const;
+  // Applies one arithmetic instruction to a block of `count` rows. The
+  // result never shares a block with an operand, which the restrict
+  // qualifiers let the vectorizer rely on
+  static void applyBlock(OpCode op, T *__restrict out,
+                         const T *__restrict lhs, const T *__restrict rhs,
+                         std::uint8_t *__restrict error, std::size_t count);
+
+  std::vector<Instruction> m_code;
+  std::vector<T> m_constants;
+  std::vector<std::string> m_variables;
+  std::map<std::string, std::uint32_t> m_slots;
+  // Tape positions of each instruction's operands, used by gradient()
+  std::vector<std::uint32_t> m_operands;
+  std::uint32_t m_result {0};
+  std::size_t m_registerCount {0};
+  mutable std::vector<T> m_registers;
+  mutable std::vector<T> m_values;
+  mutable std::vector<T> m_adjoints;
+};
+
+#include "../src/compiled.tpp"
+
+#endif // COMPILED_HPP
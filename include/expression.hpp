@@ -1,19 +1,34 @@
 #ifndef EXPRESSION_HPP
 #define EXPRESSION_HPP
 
+#include "compiled.hpp"
+#include "pool.hpp"
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
+// Value of an expression together with its partial derivative with respect
+// to every variable it contains
+template <typename T> struct Gradient {
+  T value;
+  std::map<std::string, T> partials;
+};
+
+// Handle to a node in an ExpressionPool<T>. New expressions are built in
+// the operands' pool, leaves in ExpressionPool<T>::current().
 template <typename T> class Expression {
 public:
+  using Pool = ExpressionPool<T>;
+  using Index = typename Pool::Index;
+
   // Constructors
   Expression() = default;
   Expression(T val);
   Expression(const std::string &var);
-  Expression(std::shared_ptr<Expression<T>> leftExpr, char op,
-             std::shared_ptr<Expression<T>> rightExpr);
-  Expression(std::shared_ptr<Expression<T>> leftExpr, char op);
+  Expression(const Expression<T> &leftExpr, char op,
+             const Expression<T> &rightExpr);
+  Expression(const Expression<T> &leftExpr, char op);
 
   static Expression<T> fromString(const std::string& exprString);
 
@@ -24,6 +39,7 @@ public:
   Expression<T> operator/(const Expression<T> &other) const;
   Expression<T> operator^(const Expression<T> &other) const;
   Expression<T> operator-() const;
+  // O(1) within a pool: nodes are hash-consed, so equal means same index
   bool operator==(const Expression<T>& other) const;
 
   // Math functions
@@ -35,18 +51,92 @@ public:
   // Utility functions
   Expression<T> substitute(const std::string &var, T val) const;
   T evaluate(const std::map<std::string, T> &context) const;
+  std::size_t evaluateBatch(const std::map<std::string, const T *> &columns,
+                            std::size_t rows, T *result, std::uint8_t *errors,
+                            ThreadPool *pool = nullptr) const;
   Expression<T> derivative(const std::string &var) const;
+  Gradient<T> gradient(const std::map<std::string, T> &context) const;
+  // Rewrites into a canonical form until nothing changes: sums and products
+  // are flattened, constants folded, like terms and powers of the same base
+  // collected, and operands put in a deterministic order
   Expression<T> simplify() const;
   std::string toString() const;
 
+  // Size of the expression as a tree (shared subexpressions counted once per
+  // use) and the number of distinct nodes it actually occupies
+  std::size_t nodeCount() const;
+  std::size_t uniqueNodeCount() const;
+
+  const std::shared_ptr<Pool> &pool() const;
+
+  // Flattens the expression into a tape with one instruction per distinct
+  // node. Slots are assigned in order
+  // of first appearance, or fixed by `variables` (any other variable throws)
+  CompiledExpression<T> compile() const;
+  CompiledExpression<T> compile(const std::vector<std::string> &variables) const;
+
 private:
-  T m_val;
-  std::string m_var;
-  bool m_isVal;
-  bool m_isVar;
-  std::shared_ptr<Expression<T>> m_leftExpr;
-  std::shared_ptr<Expression<T>> m_rightExpr;
-  char m_operation;
+  using Node = typename Pool::Node;
+
+  // Operand of a flattened sum (rest scaled by coefficient) or product
+  // (base raised to power)
+  struct Term {
+    Index rest;
+    T coefficient;
+  };
+
+  Expression(std::shared_ptr<Pool> pool, Index index);
+
+  Expression<T> make(Index index) const;
+  Expression<T> make(char op, const Expression<T> &other) const;
+  // Index of `other` in this expression's pool, copied over if needed
+  Index adopt(const Expression<T> &other) const;
+
+  // Calls visit(index) for each node reachable from `root` that is not
+  // done(index) yet, after visiting its operands. operands(index, list)
+  // appends the nodes a node depends on, the overload taking a pool uses its
+  // children. Runs on an explicit stack, so depth is only limited by memory
+  template <typename Operands, typename Done, typename Visit>
+  static void postOrder(Index root, Operands operands, Done done, Visit visit);
+  template <typename Done, typename Visit>
+  static void postOrder(const Pool &pool, Index root, Done done, Visit visit);
+
+  // Workers operating directly on pool indices, none of them recursive.
+  // `memo` maps nodes that existed when the call started to their result, so
+  // shared subexpressions are only processed once
+  static Index copy(Pool &to, const Pool &from, Index index,
+                    std::vector<Index> &memo);
+  static bool equal(const Pool &a, Index left, const Pool &b, Index right);
+  static Index negate(Pool &pool, Index index);
+  static Index substitute(Pool &pool, Index index, std::uint32_t var, T val,
+                          std::vector<Index> &memo);
+  static T evaluate(const Pool &pool, Index index,
+                    const std::map<std::string, T> &context);
+  static Index derivative(Pool &pool, Index index, std::uint32_t var,
+                          std::vector<Index> &memo);
+  // Node constructor used by derivative(): applies constant folding and the
+  // identities for 0 and 1 on the spot, so intermediate results stay small
+  static Index build(Pool &pool, Index leftExpr, char op, Index rightExpr);
+  // One bottom-up canonicalization pass, simplify() iterates it
+  static Index canonicalize(Pool &pool, Index index, std::vector<Index> &memo);
+  static void collectTerms(Pool &pool, Index index, T sign,
+                           std::vector<Term> &terms, T &constant);
+  static void collectFactors(const Pool &pool, Index index, T power,
+                             std::vector<Term> &factors, T &coefficient);
+  static Index buildSum(Pool &pool, std::vector<Term> &terms, T constant);
+  static Index buildProduct(Pool &pool, std::vector<Term> &factors,
+                            T coefficient);
+  static void mergeTerms(const Pool &pool, std::vector<Term> &terms);
+  // Deterministic order: numbers, variables, then operations by digest
+  static int compare(const Pool &pool, Index left, Index right);
+  static std::string toString(const Pool &pool, Index index);
+  static std::size_t nodeCount(const Pool &pool, Index index,
+                               std::vector<std::size_t> &counts);
+  static void compileInto(const Pool &pool, Index index,
+                          CompiledExpression<T> &program, bool fixedSlots);
+
+  std::shared_ptr<Pool> m_pool;
+  Index m_index {Pool::None};
 };
 
 #include "../src/expression.tpp"
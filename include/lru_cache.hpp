@@ -0,0 +1,45 @@
+#ifndef LRU_CACHE_HPP
+#define LRU_CACHE_HPP
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe map holding at most `capacity` entries, dropping the least
+// recently used one when full. Values are shared, so an entry evicted while
+// someone still works on it stays alive until they are done.
+template <typename K, typename V> class LruCache {
+public:
+  explicit LruCache(std::size_t capacity);
+
+  LruCache(const LruCache &) = delete;
+  LruCache &operator=(const LruCache &) = delete;
+
+  // Entry for `key`, default-constructed on a miss
+  std::shared_ptr<V> get(const K &key);
+
+  std::size_t size() const;
+  std::size_t capacity() const;
+  std::size_t hits() const;
+  std::size_t misses() const;
+  std::size_t evictions() const;
+
+private:
+  using Item = std::pair<K, std::shared_ptr<V>>;
+
+  // Most recently used first
+  std::list<Item> m_items;
+  std::unordered_map<K, typename std::list<Item>::iterator> m_index;
+  std::size_t m_capacity;
+  std::size_t m_hits;
+  std::size_t m_misses;
+  std::size_t m_evictions;
+  mutable std::mutex m_mutex;
+};
+
+#include "../src/lru_cache.tpp"
+
+#endif // LRU_CACHE_HPP
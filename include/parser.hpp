@@ -1,8 +1,9 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
-#include <vector>
+#include <cstddef>
 #include <string>
+#include <vector>
 
 // Forward declaration
 template <typename T> class Expression;
@@ -16,31 +17,80 @@ enum class TokenType {
   ParenthesisRight,
 };
 
+// Points into the parsed source instead of owning a copy of its text
 struct Token {
   TokenType type;
-  std::string strValue;
+  const char *text;
+  std::size_t length;
+  std::size_t position;
+
+  Token(TokenType type, const char *text, std::size_t length,
+        std::size_t position)
+      : type {type}, text {text}, length {length}, position {position} {}
 
-  Token(TokenType type, std::string strValue) : type {type}, strValue {strValue} {}
+  std::string str() const { return std::string(text, length); }
 };
 
 namespace parser {
+// Appends the tokens of source[0, length) to `tokens`. Throws on characters
+// that cannot start a token, with their position in the message
+void tokenize(const char *source, std::size_t length,
+              std::vector<Token> &tokens);
+
 std::vector<Token> tokenize(const std::string &strExpr);
 
-Token nextToken(std::vector<Token>& tokens);
+// Iterative operator-precedence parser: operands and pending operators live
+// on explicit stacks, so nesting depth is not limited by the call stack and
+// parsing is linear in the number of tokens. Buffers are reused between
+// calls, so parsing many expressions with one Parser does not allocate per
+// token once they have grown
+template <typename T> class Parser {
+public:
+  Expression<T> parse(const char *source, std::size_t length);
+  Expression<T> parse(const std::vector<Token> &tokens);
+
+private:
+  // Operator waiting for its operands: a binary operator, unary minus
+  // ('~'), an opening parenthesis ('(') or a function call (its name's
+  // first letter, already past its opening parenthesis)
+  struct Pending {
+    char operation;
+    std::size_t position;
+  };
 
-template <typename T>
-Expression<T> parseExpression(std::vector<Token>& tokens);
+  static int precedence(char operation);
+  void reduce();
 
-template <typename T>
-Expression<T> parseTerm(std::vector<Token>& tokens);
+  std::vector<Token> m_tokens;
+  std::vector<Expression<T>> m_operands;
+  std::vector<Pending> m_operators;
+  std::string m_scratch;
+};
+
+// Read-only view of a whole file, memory-mapped so large inputs are not
+// copied into the process
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
 
-template <typename T>
-Expression<T> parseFactor(std::vector<Token>& tokens);
+  const char *data() const;
+  std::size_t size() const;
+
+private:
+  const char *m_data;
+  std::size_t m_size;
+};
 
-template <typename T>
-Expression<T> parsePrimary(std::vector<Token>& tokens);
+// Calls handle(line, length, lineNumber) for every line of data[0, length),
+// empty ones included, without copying the lines
+template <typename F>
+void forEachLine(const char *data, std::size_t length, F handle);
 }; // namespace parser
 
 #include "../src/parser.tpp"
 
-#endif 
+#endif
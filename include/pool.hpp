@@ -0,0 +1,99 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Arena holding the nodes of every expression built in it. Nodes are compact
+// tagged records addressed by 32-bit indices and hash-consed, so identical
+// subexpressions share one node. Variable names are interned once into a
+// symbol table. Nodes are never freed individually: the whole pool goes away
+// with the last Expression<T> referring to it. The thread's current pool is
+// only held weakly, so once every expression in it is gone the next one
+// starts a new pool.
+//
+// A pool is not thread-safe. Expressions in it may be read concurrently, but
+// building new nodes (operators, derivative(), simplify(), ...) must happen
+// on one thread at a time.
+template <typename T> class ExpressionPool {
+public:
+  using Index = std::uint32_t;
+
+  static const Index None {0xffffffffu};
+
+  // Tags of leaf nodes, operations use their operator character
+  static const char Value {'#'};
+  static const char Variable {'$'};
+
+  struct Node {
+    char operation;
+    Index leftExpr;
+    Index rightExpr;
+    // Hash of the subtree's structure, independent of indices and pools, so
+    // different digests mean different expressions. Fits in what would
+    // otherwise be padding
+    std::uint32_t digest;
+
+    union {
+      T val;
+      std::uint32_t symbol;
+    };
+  };
+
+  ExpressionPool();
+
+  Index value(T val);
+  Index variable(const std::string &var);
+  Index node(Index leftExpr, char op, Index rightExpr = None);
+
+  const Node &operator[](Index index) const;
+
+  const std::string &symbol(std::uint32_t id) const;
+  // Returns the number of interned symbols if the variable was never
+  // interned
+  std::uint32_t findSymbol(const std::string &var) const;
+
+  std::size_t size() const;
+
+  // Pool that new expressions are built in on the calling thread, created
+  // if the previous one has been freed
+  static std::shared_ptr<ExpressionPool<T>> current();
+
+  // Makes a fresh pool current on this thread for the scope's lifetime, so
+  // everything built meanwhile (e.g. one derivation) is freed together
+  class Scope {
+  public:
+    Scope();
+    ~Scope();
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    std::shared_ptr<ExpressionPool<T>> m_pool;
+    std::weak_ptr<ExpressionPool<T>> m_previous;
+  };
+
+private:
+  static std::weak_ptr<ExpressionPool<T>> &currentSlot();
+
+  Index intern(const Node &node);
+  std::size_t hash(const Node &node) const;
+  std::uint32_t digest(const Node &node) const;
+  bool equal(const Node &a, const Node &b) const;
+  void rehash(std::size_t capacity);
+
+  std::vector<Node> m_nodes;
+  // Open addressing table of node indices, None marks a free bucket
+  std::vector<Index> m_table;
+  std::vector<std::string> m_symbols;
+  std::unordered_map<std::string, std::uint32_t> m_symbolIds;
+};
+
+#include "../src/pool.tpp"
+
+#endif // POOL_HPP
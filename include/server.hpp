@@ -0,0 +1,92 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "expression.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Long-running request loop behind `differentiator --serve`. Requests are
+// single lines:
+//
+//   eval [var=value ...] expression
+//   diff var expression
+//   simplify expression
+//   stats
+//
+// and every request gets exactly one response line, in request order
+// (`error: ...` when it fails). Requests are handled concurrently on a
+// worker pool. Parsed expressions and their results are kept in an LRU
+// cache keyed by expression string and differentiation variable, so
+// repeated requests skip tokenizing, parsing, deriving and simplifying.
+class Server {
+public:
+  // Zero threads means one worker per hardware thread
+  Server(std::size_t threads, std::size_t cacheCapacity);
+
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  // Serves requests read from `input` until end of file, writing responses
+  // to `output`. Several sessions can share one server
+  void session(int input, int output);
+
+  // Accepts connections on a Unix domain socket at `path`, one session
+  // each, until SIGINT or SIGTERM. Then open sessions finish the requests
+  // already read, the socket file is removed and listen returns. A socket
+  // already at `path` is replaced. Throws if `path` is any other kind of
+  // file or the socket cannot be set up
+  void listen(const std::string &path);
+
+  std::string handle(const std::string &request);
+
+private:
+  // Everything known about one expression (and variable, for diff).
+  // Expressions are built in the entry's own pool, which is not
+  // thread-safe, so all work on an entry happens under its mutex
+  struct Entry {
+    std::mutex mutex;
+    bool parsed {false};
+    std::string error;
+    Expression<double> expr;
+    std::string simplified;
+    std::string derivative;
+    std::shared_ptr<const CompiledExpression<double>> program;
+  };
+
+  std::shared_ptr<Entry> lookup(const std::string &expression,
+                                const std::string &var);
+  // Parses the entry's expression on first use, throws its parse error
+  void parse(Entry &entry, const std::string &expression);
+
+  std::string evaluate(const std::string &arguments);
+  std::string differentiate(const std::string &arguments);
+  std::string simplify(const std::string &expression);
+  std::string stats() const;
+
+  // Word starting at or after `position`, which is moved past it
+  static std::string nextWord(const std::string &text, std::size_t &position);
+  static std::string trim(const std::string &text);
+  static bool writeAll(int output, const std::string &data);
+  // Pipe that wakes listen() up when the process is asked to stop
+  static std::atomic<int> *stopPipe();
+  static void onStop(int);
+
+  // Responses that may be pending per session before reading stops
+  std::size_t m_window;
+  ThreadPool m_workers;
+  LruCache<std::string, Entry> m_cache;
+  std::atomic<std::size_t> m_requests;
+  std::atomic<std::size_t> m_errors;
+  std::chrono::steady_clock::time_point m_started;
+};
+
+#include "../src/server.tpp"
+
+#endif // SERVER_HPP
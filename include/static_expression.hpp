@@ -0,0 +1,172 @@
+#ifndef STATIC_EXPRESSION_HPP
+#define STATIC_EXPRESSION_HPP
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Forward declaration
+template <typename T> class Expression;
+
+// Expressions fixed at build time, encoded in their type. Operators and
+// sin/cos/ln/exp mirror Expression<T>, but build nested node types instead
+// of pool nodes, so derivative<Var>() is a type transformation done by the
+// compiler and evaluate() inlines to straight-line code.
+//
+//   constexpr static_expr::Variable<0> x {};
+//   constexpr static_expr::Variable<1> y {};
+//
+//   auto f = x * static_expr::sin(y) + (x ^ static_expr::Integer<3> {});
+//   auto dfdx = static_expr::derivative<decltype(x)>(f);
+//
+//   double slots[] {1.5, 0.5};
+//   double value {dfdx.evaluate(slots)};
+//
+// Variables are numbered slots, as in CompiledExpression<T>. Integer<N>
+// constants are part of the type, so the identities for 0 and 1 and integer
+// arithmetic are applied while the types are built; other constants are
+// Value<A> and kept for evaluation. Evaluation does no domain checks
+// (x / 0 is inf, ln of a negative number NaN).
+namespace static_expr {
+// Common base of the node types, marks what the operators accept
+struct Base {};
+
+template <typename E> struct IsExpression : std::is_base_of<Base, E> {};
+
+template <long N> struct Integer : Base {
+  static constexpr long value {N};
+
+  template <typename T> T evaluate(const T *slots) const;
+  template <typename T>
+  Expression<T> toExpression(const std::vector<std::string> &variables) const;
+};
+
+template <typename A> struct Value : Base {
+  A val;
+
+  explicit Value(A val) : val {val} {}
+
+  template <typename T> T evaluate(const T *slots) const;
+  template <typename T>
+  Expression<T> toExpression(const std::vector<std::string> &variables) const;
+};
+
+template <std::size_t Slot> struct Variable : Base {
+  static constexpr std::size_t slot {Slot};
+
+  template <typename T> T evaluate(const T *slots) const;
+  template <typename T>
+  Expression<T> toExpression(const std::vector<std::string> &variables) const;
+};
+
+// Operations use the node tags of ExpressionPool: '+', '-', '*', '/', '^',
+// and for unary ones '-' and the first letter of the function's name
+template <char Op, typename L, typename R> struct Binary : Base {
+  L left;
+  R right;
+
+  Binary(const L &left, const R &right) : left (left), right (right) {}
+
+  template <typename T> T evaluate(const T *slots) const;
+  template <typename T>
+  Expression<T> toExpression(const std::vector<std::string> &variables) const;
+};
+
+template <char Op, typename U> struct Unary : Base {
+  U operand;
+
+  explicit Unary(const U &operand) : operand (operand) {}
+
+  template <typename T> T evaluate(const T *slots) const;
+  template <typename T>
+  Expression<T> toExpression(const std::vector<std::string> &variables) const;
+};
+
+// What a node reduces to under the simplification rules: itself, an
+// Integer<N> computed from integer operands, one of its operands, 0 or 1,
+// the negated right operand (0 - u), or the operand of its unary operand
+// (-(-u), ln(exp(u)))
+enum class Rule { Keep, Fold, Left, Right, Zero, One, Negate, Inner };
+
+template <char Op, typename L, typename R> constexpr Rule binaryRule();
+template <char Op, typename U> constexpr Rule unaryRule();
+
+// Type built for `left Op right` (or `Op operand`) once the rules have been
+// applied, and make() building it
+template <char Op, typename L, typename R, Rule = binaryRule<Op, L, R>()>
+struct Make;
+template <char Op, typename U, Rule = unaryRule<Op, U>()> struct MakeUnary;
+
+template <char Op, typename L, typename R>
+typename Make<Op, L, R>::type build(const L &left, const R &right);
+template <char Op, typename U>
+typename MakeUnary<Op, U>::type build(const U &operand);
+
+// Constant operands other than Integer<N> become Value<A>
+template <typename E, bool = IsExpression<E>::value> struct Operand;
+
+template <typename E> struct Operand<E, true> {
+  using type = E;
+
+  static const E &make(const E &expr) { return expr; }
+};
+
+template <typename A> struct Operand<A, false> {
+  using type = Value<A>;
+
+  static type make(A val) { return type {val}; }
+};
+
+template <typename L, typename R>
+using EnableBinary = typename std::enable_if<
+  (IsExpression<L>::value || IsExpression<R>::value) &&
+  (IsExpression<L>::value || std::is_arithmetic<L>::value) &&
+  (IsExpression<R>::value || std::is_arithmetic<R>::value)>::type;
+
+template <char Op, typename L, typename R>
+using BinaryResult = typename Make<Op, typename Operand<L>::type,
+                                   typename Operand<R>::type>::type;
+
+// Operators
+template <typename L, typename R, typename = EnableBinary<L, R>>
+BinaryResult<'+', L, R> operator+(const L &left, const R &right);
+template <typename L, typename R, typename = EnableBinary<L, R>>
+BinaryResult<'-', L, R> operator-(const L &left, const R &right);
+template <typename L, typename R, typename = EnableBinary<L, R>>
+BinaryResult<'*', L, R> operator*(const L &left, const R &right);
+template <typename L, typename R, typename = EnableBinary<L, R>>
+BinaryResult<'/', L, R> operator/(const L &left, const R &right);
+template <typename L, typename R, typename = EnableBinary<L, R>>
+BinaryResult<'^', L, R> operator^(const L &left, const R &right);
+
+template <typename U, typename = typename std::enable_if<
+                        IsExpression<U>::value>::type>
+typename MakeUnary<'-', U>::type operator-(const U &operand);
+
+// Math functions
+template <typename U> typename MakeUnary<'s', U>::type sin(const U &operand);
+template <typename U> typename MakeUnary<'c', U>::type cos(const U &operand);
+template <typename U> typename MakeUnary<'l', U>::type ln(const U &operand);
+template <typename U> typename MakeUnary<'e', U>::type exp(const U &operand);
+
+// d/dVar of E, itself simplified by the same rules
+template <typename E, typename Var> struct Derivative;
+
+template <typename Var, typename E>
+typename Derivative<E, typename std::remove_cv<Var>::type>::type
+derivative(const E &expr);
+
+template <typename Var, typename E>
+typename Derivative<E, Var>::type derivative(const E &expr, const Var &);
+
+// Runtime copy of the expression, built in ExpressionPool<T>::current().
+// variables[slot] names each slot's variable
+template <typename T, typename E>
+Expression<T> toExpression(const E &expr,
+                           const std::vector<std::string> &variables);
+} // namespace static_expr
+
+#include "../src/static_expression.tpp"
+
+#endif // STATIC_EXPRESSION_HPP
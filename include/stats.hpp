@@ -0,0 +1,60 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Instrumentation for the differentiator's --stats flag and the benchmarks.
+//
+// Allocations are only counted in programs that link src/allocations.cpp,
+// which replaces the global operator new and delete. The plain differentiator
+// does not, so its allocations cost nothing extra and are reported as
+// unknown.
+namespace stats {
+struct Allocations {
+  std::size_t count;
+  std::size_t bytes;
+  // False when allocations.cpp is not linked in, the totals are then zero
+  bool counted;
+};
+
+// Totals on the calling thread since it started
+Allocations allocations();
+
+// Wall time, allocations and node count of one named step
+struct Phase {
+  std::string name;
+  double seconds;
+  std::size_t allocations;
+  std::size_t bytes;
+  std::size_t nodes;
+};
+
+class Profile {
+public:
+  // `nodes` reports the current number of nodes (the pool size) after each
+  // phase. Pools only grow, so its largest value is the peak
+  explicit Profile(std::function<std::size_t()> nodes = nullptr);
+
+  // Runs task() as the next phase. If it throws, nothing is recorded
+  template <typename F> void measure(const std::string &name, F task);
+
+  const std::vector<Phase> &phases() const;
+  // One row per phase, then a total whose node count is the peak
+  void print(std::ostream &out) const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  std::function<std::size_t()> m_nodes;
+  std::vector<Phase> m_phases;
+};
+} // namespace stats
+
+#include "../src/stats.tpp"
+
+#endif // STATS_HPP
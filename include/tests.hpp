@@ -12,12 +12,34 @@ template <typename T> void operators();
 
 template <typename T> void mathFunctions();
 
+template <typename T> void parsing();
+
+template <typename T> void deepExpressions();
+
 template <typename T> void substitution();
 
 template <typename T> void evaluation();
 
+template <typename T> void compilation();
+
+template <typename T> void batchEvaluation();
+
 template <typename T> void derivative();
 
+template <typename T> void simplification();
+
+template <typename T> void sharing();
+
+template <typename T> void gradient();
+
+template <typename T> void staticExpressions();
+
+template <typename T> void pools();
+
+template <typename T> void lruCache();
+
+template <typename T> void server();
+
 template <typename T> void toString();
 
 template <typename T> void all();
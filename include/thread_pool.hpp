@@ -0,0 +1,41 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from a shared queue
+class ThreadPool {
+public:
+  // Zero means one worker per hardware thread
+  explicit ThreadPool(std::size_t threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> submit(F task);
+
+  std::size_t size() const;
+
+private:
+  void work();
+
+  std::vector<std::thread> m_workers;
+  std::queue<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  bool m_stopping;
+};
+
+#include "../src/thread_pool.tpp"
+
+#endif // THREAD_POOL_HPP
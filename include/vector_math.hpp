@@ -0,0 +1,38 @@
+#ifndef VECTOR_MATH_HPP
+#define VECTOR_MATH_HPP
+
+#include <cstddef>
+
+// Elementwise math functions over blocks of values, used by the batch
+// evaluator. Each writes f(in[i]) to out[i] for `count` rows, `in` and `out`
+// must not overlap.
+//
+// The double overloads are branch-free range reductions and polynomials the
+// compiler vectorizes, accurate to a couple of ulp. Rows outside a kernel's
+// range (infinities, NaN, subnormals, huge sin/cos arguments, results that
+// over- or underflow) are patched afterwards with the std:: function, so
+// edge cases match it exactly. Other types call std:: per row. There is no
+// kernel for ^: through exp(y * ln|x|) even integer powers come out inexact
+namespace vector_math {
+template <typename T>
+void exp(const T *__restrict in, T *__restrict out, std::size_t count);
+template <typename T>
+void log(const T *__restrict in, T *__restrict out, std::size_t count);
+template <typename T>
+void sin(const T *__restrict in, T *__restrict out, std::size_t count);
+template <typename T>
+void cos(const T *__restrict in, T *__restrict out, std::size_t count);
+
+inline void exp(const double *__restrict in, double *__restrict out,
+                std::size_t count);
+inline void log(const double *__restrict in, double *__restrict out,
+                std::size_t count);
+inline void sin(const double *__restrict in, double *__restrict out,
+                std::size_t count);
+inline void cos(const double *__restrict in, double *__restrict out,
+                std::size_t count);
+} // namespace vector_math
+
+#include "../src/vector_math.tpp"
+
+#endif // VECTOR_MATH_HPP
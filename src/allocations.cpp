@@ -0,0 +1,41 @@
+// Counting replacements for the global operator new and delete, behind the
+// allocation figures of --stats and the benchmarks. Replacements can not be
+// inline, so they live in this one translation unit, and only the builds
+// that report allocations link it: everywhere else new is the library's.
+#include "../include/stats.hpp"
+#include <cstdlib>
+#include <new>
+
+namespace {
+// Per thread, so no shared counter for threads to contend on
+thread_local std::size_t allocationCount {0};
+thread_local std::size_t allocationBytes {0};
+} // namespace
+
+stats::Allocations stats::detail::countedAllocations() {
+  return Allocations {allocationCount, allocationBytes, true};
+}
+
+void *operator new(std::size_t size) {
+  ++allocationCount;
+  allocationBytes += size;
+
+  if (size == 0) size = 1;
+
+  for (;;) {
+    if (void *memory = std::malloc(size)) return memory;
+
+    std::new_handler handler {std::get_new_handler()};
+    if (!handler) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void *operator new[](std::size_t size) { return ::operator new(size); }
+
+// Kept out of line so the compiler does not see new paired with free()
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept { ::operator delete(memory); }
@@ -0,0 +1,456 @@
+#ifndef COMPILED_TPP
+#define COMPILED_TPP
+
+#include "../include/compiled.hpp"
+#include "../include/thread_pool.hpp"
+#include "../include/vector_math.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+template <typename T>
+T CompiledExpression<T>::evaluate(const T *slots, T *registers) const {
+  for (const Instruction &instruction : m_code) {
+    T &result {registers[instruction.target]};
+
+    switch (instruction.op) {
+      case OpCode::Constant: result = m_constants[instruction.arg]; break;
+      case OpCode::Load: result = slots[instruction.arg]; break;
+
+      case OpCode::Add:
+        result = registers[instruction.left] + registers[instruction.right];
+        break;
+
+      case OpCode::Sub:
+        result = registers[instruction.left] - registers[instruction.right];
+        break;
+
+      case OpCode::Mul:
+        result = registers[instruction.left] * registers[instruction.right];
+        break;
+
+      case OpCode::Div:
+        if (registers[instruction.right] == 0)
+          throw std::runtime_error("Division by zero");
+        result = registers[instruction.left] / registers[instruction.right];
+        break;
+
+      case OpCode::Pow:
+        result = std::pow(registers[instruction.left],
+                          registers[instruction.right]);
+        break;
+
+      case OpCode::Neg: result = -registers[instruction.left]; break;
+      case OpCode::Sin: result = std::sin(registers[instruction.left]); break;
+      case OpCode::Cos: result = std::cos(registers[instruction.left]); break;
+      case OpCode::Ln:
+        if (!(registers[instruction.left] > 0))
+          throw std::runtime_error("Invalid argument for ln()");
+        result = std::log(registers[instruction.left]);
+        break;
+
+      case OpCode::Exp: result = std::exp(registers[instruction.left]); break;
+    }
+  }
+
+  return registers[m_code[m_result].target];
+}
+
+template <typename T>
+T CompiledExpression<T>::evaluate(const std::vector<T> &slots) const {
+  if (slots.size() < m_variables.size())
+    throw std::runtime_error("Variable not found");
+
+  return evaluate(slots.data(), m_registers.data());
+}
+
+template <typename T>
+T CompiledExpression<T>::evaluate(
+  const std::map<std::string, T> &context) const {
+  std::vector<T> slots;
+  slots.reserve(m_variables.size());
+
+  for (const std::string &var : m_variables) {
+    auto it {context.find(var)};
+
+    if (it == context.end()) throw std::runtime_error("Variable not found");
+    slots.push_back(it->second);
+  }
+
+  return evaluate(slots);
+}
+
+template <typename T>
+T CompiledExpression<T>::gradient(const T *slots, T *partials, T *values,
+                                  T *adjoints) const {
+  std::size_t size {m_code.size()};
+
+  for (std::size_t i {0}; i < size; ++i) {
+    const Instruction &instruction {m_code[i]};
+    const T &left {values[m_operands[2 * i]]},
+      &right {values[m_operands[2 * i + 1]]};
+
+    switch (instruction.op) {
+      case OpCode::Constant: values[i] = m_constants[instruction.arg]; break;
+      case OpCode::Load: values[i] = slots[instruction.arg]; break;
+      case OpCode::Add: values[i] = left + right; break;
+      case OpCode::Sub: values[i] = left - right; break;
+      case OpCode::Mul: values[i] = left * right; break;
+      case OpCode::Div:
+        if (right == 0) throw std::runtime_error("Division by zero");
+        values[i] = left / right;
+        break;
+
+      case OpCode::Pow: values[i] = std::pow(left, right); break;
+      case OpCode::Neg: values[i] = -left; break;
+      case OpCode::Sin: values[i] = std::sin(left); break;
+      case OpCode::Cos: values[i] = std::cos(left); break;
+      case OpCode::Ln:
+        if (!(left > 0)) throw std::runtime_error("Invalid argument for ln()");
+        values[i] = std::log(left);
+        break;
+
+      case OpCode::Exp: values[i] = std::exp(left); break;
+    }
+  }
+
+  std::fill(adjoints, adjoints + size, T(0));
+  std::fill(partials, partials + m_variables.size(), T(0));
+  adjoints[m_result] = T(1);
+
+  for (std::size_t i {size}; i-- > 0;) {
+    std::uint32_t l {m_operands[2 * i]}, r {m_operands[2 * i + 1]};
+    T adjoint {adjoints[i]};
+
+    switch (m_code[i].op) {
+      case OpCode::Constant: break;
+      case OpCode::Load: partials[m_code[i].arg] += adjoint; break;
+
+      case OpCode::Add:
+        adjoints[l] += adjoint;
+        adjoints[r] += adjoint;
+        break;
+
+      case OpCode::Sub:
+        adjoints[l] += adjoint;
+        adjoints[r] -= adjoint;
+        break;
+
+      case OpCode::Mul:
+        adjoints[l] += adjoint * values[r];
+        adjoints[r] += adjoint * values[l];
+        break;
+
+      case OpCode::Div:
+        adjoints[l] += adjoint / values[r];
+        adjoints[r] -= adjoint * values[i] / values[r];
+        break;
+
+      // The exponent's partial needs ln(base), which only exists for a
+      // positive base. 0 ^ y is constant for positive y, anywhere else the
+      // partial is undefined and comes out as NaN, unless the exponent is a
+      // constant that has none. A zero exponent makes the power constant,
+      // even where base ^ -1 is infinite
+      case OpCode::Pow:
+        if (values[r] != 0)
+          adjoints[l] +=
+            adjoint * values[r] * std::pow(values[l], values[r] - T(1));
+        if (values[l] > 0)
+          adjoints[r] += adjoint * values[i] * std::log(values[l]);
+        else if (adjoint != 0 && m_code[r].op != OpCode::Constant &&
+                 !(values[l] == 0 && values[r] > 0))
+          adjoints[r] = std::numeric_limits<T>::quiet_NaN();
+        break;
+
+      case OpCode::Neg: adjoints[l] -= adjoint; break;
+      case OpCode::Sin: adjoints[l] += adjoint * std::cos(values[l]); break;
+      case OpCode::Cos: adjoints[l] -= adjoint * std::sin(values[l]); break;
+      case OpCode::Ln: adjoints[l] += adjoint / values[l]; break;
+      case OpCode::Exp: adjoints[l] += adjoint * values[i]; break;
+    }
+  }
+
+  return values[m_result];
+}
+
+template <typename T>
+T CompiledExpression<T>::gradient(const std::vector<T> &slots,
+                                  std::vector<T> &partials) const {
+  if (slots.size() < m_variables.size())
+    throw std::runtime_error("Variable not found");
+
+  partials.resize(m_variables.size());
+
+  return gradient(slots.data(), partials.data(), m_values.data(),
+                  m_adjoints.data());
+}
+
+template <typename T>
+std::size_t CompiledExpression<T>::evaluateBatch(const T *const *columns,
+                                                 std::size_t rows, T *result,
+                                                 std::uint8_t *errors,
+                                                 ThreadPool *pool) const {
+  std::size_t blocks {(rows + BatchBlock - 1) / BatchBlock};
+  std::atomic<std::size_t> nextBlock {0};
+
+  // Each worker owns its register blocks and claims blocks of rows until
+  // none are left
+  auto worker = [&]() {
+    std::vector<T> registers(m_registerCount * BatchBlock);
+
+    for (std::size_t block {nextBlock++}; block < blocks;
+         block = nextBlock++) {
+      std::size_t begin {block * BatchBlock};
+
+      evaluateBlock(columns, begin, std::min(BatchBlock, rows - begin),
+                    result, errors, registers.data());
+    }
+  };
+
+  if (pool && pool->size() > 1 && blocks > 1) {
+    std::vector<std::future<void>> workers;
+
+    for (std::size_t i {0}; i < std::min(pool->size(), blocks); ++i)
+      workers.push_back(pool->submit(worker));
+
+    for (std::future<void> &done : workers) done.get();
+  } else worker();
+
+  return static_cast<std::size_t>(std::count(errors, errors + rows, 1));
+}
+
+// Same tape walk as evaluate(), but every register is a block of `count`
+// rows, so each instruction becomes a tight loop the compiler can vectorize,
+// or one of the vector_math kernels for sin, cos, ln and exp. ^ calls
+// std::pow per row, so it stays exact
+template <typename T>
+void CompiledExpression<T>::evaluateBlock(const T *const *columns,
+                                          std::size_t begin, std::size_t count,
+                                          T *result, std::uint8_t *errors,
+                                          T *registers) const {
+  std::uint8_t *error {errors + begin};
+
+  std::fill(error, error + count, 0);
+
+  for (const Instruction &instruction : m_code) {
+    T *out {registers + instruction.target * BatchBlock};
+
+    switch (instruction.op) {
+      case OpCode::Constant:
+        std::fill(out, out + count, m_constants[instruction.arg]);
+        break;
+
+      case OpCode::Load:
+        std::copy(columns[instruction.arg] + begin,
+                  columns[instruction.arg] + begin + count, out);
+        break;
+
+      default:
+        applyBlock(instruction.op, out,
+                   registers + instruction.left * BatchBlock,
+                   registers + instruction.right * BatchBlock, error, count);
+        break;
+    }
+  }
+
+  const T *value {registers + m_code[m_result].target * BatchBlock};
+
+  for (std::size_t i {0}; i < count; ++i)
+    result[begin + i] =
+      error[i] ? std::numeric_limits<T>::quiet_NaN() : value[i];
+}
+
+template <typename T>
+void CompiledExpression<T>::applyBlock(OpCode op, T *__restrict out,
+                                       const T *__restrict lhs,
+                                       const T *__restrict rhs,
+                                       std::uint8_t *__restrict error,
+                                       std::size_t count) {
+  switch (op) {
+    case OpCode::Add:
+      for (std::size_t i {0}; i < count; ++i) out[i] = lhs[i] + rhs[i];
+      break;
+
+    case OpCode::Sub:
+      for (std::size_t i {0}; i < count; ++i) out[i] = lhs[i] - rhs[i];
+      break;
+
+    case OpCode::Mul:
+      for (std::size_t i {0}; i < count; ++i) out[i] = lhs[i] * rhs[i];
+      break;
+
+    case OpCode::Div:
+      // Written as selects rather than |= so they vectorize too
+      for (std::size_t i {0}; i < count; ++i)
+        error[i] = rhs[i] == T(0) ? 1 : error[i];
+      for (std::size_t i {0}; i < count; ++i) out[i] = lhs[i] / rhs[i];
+      break;
+
+    case OpCode::Pow:
+      for (std::size_t i {0}; i < count; ++i)
+        out[i] = std::pow(lhs[i], rhs[i]);
+      break;
+
+    case OpCode::Neg:
+      for (std::size_t i {0}; i < count; ++i) out[i] = -lhs[i];
+      break;
+
+    case OpCode::Sin:
+      vector_math::sin(lhs, out, count);
+      break;
+
+    case OpCode::Cos:
+      vector_math::cos(lhs, out, count);
+      break;
+
+    case OpCode::Ln:
+      for (std::size_t i {0}; i < count; ++i)
+        error[i] = lhs[i] > T(0) ? error[i] : 1;
+      vector_math::log(lhs, out, count);
+      break;
+
+    case OpCode::Exp:
+      vector_math::exp(lhs, out, count);
+      break;
+
+    default: break;
+  }
+}
+
+template <typename T> const std::size_t CompiledExpression<T>::BatchBlock;
+
+template <typename T> std::size_t CompiledExpression<T>::slotCount() const {
+  return m_variables.size();
+}
+
+template <typename T>
+std::size_t CompiledExpression<T>::registerCount() const {
+  return m_registerCount;
+}
+
+template <typename T> std::size_t CompiledExpression<T>::size() const {
+  return m_code.size();
+}
+
+template <typename T>
+std::size_t CompiledExpression<T>::slotOf(const std::string &var) const {
+  auto it {m_slots.find(var)};
+
+  return it != m_slots.end() ? it->second : m_variables.size();
+}
+
+template <typename T>
+const std::vector<std::string> &CompiledExpression<T>::variables() const {
+  return m_variables;
+}
+
+template <typename T>
+std::uint32_t CompiledExpression<T>::addSlot(const std::string &var) {
+  auto inserted {m_slots.insert(
+    {var, static_cast<std::uint32_t>(m_variables.size())}
+  )};
+
+  if (inserted.second) m_variables.push_back(var);
+
+  return inserted.first->second;
+}
+
+template <typename T>
+std::uint32_t CompiledExpression<T>::emitConstant(T val) {
+  m_constants.push_back(val);
+
+  return push(Instruction(OpCode::Constant,
+                          static_cast<std::uint32_t>(m_constants.size() - 1)),
+              0, 0);
+}
+
+template <typename T>
+std::uint32_t CompiledExpression<T>::emitLoad(std::uint32_t slot) {
+  return push(Instruction(OpCode::Load, slot), 0, 0);
+}
+
+template <typename T>
+std::uint32_t CompiledExpression<T>::emit(OpCode op, std::uint32_t left,
+                                          std::uint32_t right) {
+  return push(Instruction(op, 0), left, right);
+}
+
+template <typename T>
+std::uint32_t CompiledExpression<T>::push(const Instruction &instruction,
+                                          std::uint32_t left,
+                                          std::uint32_t right) {
+  m_operands.push_back(left);
+  m_operands.push_back(right);
+  m_code.push_back(instruction);
+
+  return static_cast<std::uint32_t>(m_code.size() - 1);
+}
+
+// Linear scan over the tape: a register is released once the last
+// instruction reading it has been given its own, so no instruction ever
+// writes over one of its operands
+template <typename T>
+void CompiledExpression<T>::finish(std::uint32_t result) {
+  std::size_t size {m_code.size()};
+  std::vector<std::uint32_t> lastUse(size);
+
+  for (std::size_t i {0}; i < size; ++i) {
+    lastUse[i] = static_cast<std::uint32_t>(i);
+
+    for (std::size_t operand {0}; operand < operandCount(m_code[i].op);
+         ++operand)
+      lastUse[m_operands[2 * i + operand]] = static_cast<std::uint32_t>(i);
+  }
+
+  std::vector<std::uint32_t> released;
+  std::uint32_t count {0};
+
+  for (std::size_t i {0}; i < size; ++i) {
+    Instruction &instruction {m_code[i]};
+    std::uint32_t left {m_operands[2 * i]}, right {m_operands[2 * i + 1]};
+    std::size_t operands {operandCount(instruction.op)};
+
+    if (released.empty()) instruction.target = count++;
+    else {
+      instruction.target = released.back();
+      released.pop_back();
+    }
+
+    if (operands > 0) instruction.left = m_code[left].target;
+    if (operands > 1) instruction.right = m_code[right].target;
+
+    if (operands > 0 && lastUse[left] == i && left != result)
+      released.push_back(instruction.left);
+    if (operands > 1 && lastUse[right] == i && right != left &&
+        right != result)
+      released.push_back(instruction.right);
+  }
+
+  m_result = result;
+  m_registerCount = count;
+  m_registers.resize(count);
+  m_values.resize(size);
+  m_adjoints.resize(size);
+}
+
+template <typename T>
+std::size_t CompiledExpression<T>::operandCount(OpCode op) {
+  switch (op) {
+    case OpCode::Constant:
+    case OpCode::Load:
+      return 0;
+
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+    case OpCode::Pow:
+      return 2;
+
+    default: return 1;
+  }
+}
+
+#endif // COMPILED_TPP
@@ -2,394 +2,1292 @@
 #define EXPRESSION_TPP
 
 #include "../include/parser.hpp"
+#include <algorithm>
 #include <cmath>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
 
 template <typename T>
-Expression<T>::Expression(T val) : m_val{val}, m_isVal{true}, m_isVar{false} {}
+Expression<T>::Expression(T val)
+    : m_pool{Pool::current()}, m_index{m_pool->value(val)} {}
 
 template <typename T>
 Expression<T>::Expression(const std::string &var)
-    : m_var{var}, m_isVal{false}, m_isVar{true} {}
+    : m_pool{Pool::current()}, m_index{m_pool->variable(var)} {}
 
 template <typename T>
-Expression<T>::Expression(std::shared_ptr<Expression<T>> leftExpr,
-                          char operation,
-                          std::shared_ptr<Expression<T>> rightExpr)
-    : m_isVal{false}, m_isVar{false}, m_leftExpr{leftExpr},
-      m_rightExpr{rightExpr}, m_operation{operation} {}
+Expression<T>::Expression(const Expression<T> &leftExpr, char operation,
+                          const Expression<T> &rightExpr)
+    : m_pool{leftExpr.m_pool},
+      m_index{m_pool->node(leftExpr.m_index, operation,
+                           leftExpr.adopt(rightExpr))} {}
 
 template <typename T>
-Expression<T>::Expression(std::shared_ptr<Expression<T>> leftExpr,
-                          char operation)
-    : m_isVal{false}, m_isVar{false}, m_leftExpr{leftExpr},
-      m_rightExpr{nullptr}, m_operation{operation} {}
+Expression<T>::Expression(const Expression<T> &leftExpr, char operation)
+    : m_pool{leftExpr.m_pool},
+      m_index{m_pool->node(leftExpr.m_index, operation)} {}
+
+template <typename T>
+Expression<T>::Expression(std::shared_ptr<Pool> pool, Index index)
+    : m_pool{std::move(pool)}, m_index{index} {}
+
+template <typename T> Expression<T> Expression<T>::make(Index index) const {
+  return Expression<T>(m_pool, index);
+}
+
+template <typename T>
+Expression<T> Expression<T>::make(char operation,
+                                  const Expression<T> &other) const {
+  return make(m_pool->node(m_index, operation, adopt(other)));
+}
+
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::adopt(const Expression<T> &other) const {
+  if (other.m_pool == m_pool) return other.m_index;
+
+  std::vector<Index> memo(other.m_pool->size(), Pool::None);
+  return copy(*m_pool, *other.m_pool, other.m_index, memo);
+}
+
+template <typename T>
+template <typename Operands, typename Done, typename Visit>
+void Expression<T>::postOrder(Index root, Operands operands, Done done,
+                              Visit visit) {
+  // One frame per node on the current path, with the range of its operands
+  // in `dependencies` and the next one to look at. A node is visited when
+  // its frame runs out of operands. The stacks are kept per thread and only
+  // cleared, so a walk over a small expression allocates nothing. A walk
+  // started from inside a visit gets stacks of its own
+  struct Frame {
+    Index index;
+    std::size_t begin, next, end;
+  };
+
+  struct Stacks {
+    std::vector<Frame> frames;
+    std::vector<Index> dependencies;
+    bool busy {false};
+  };
+
+  static thread_local Stacks shared;
+  Stacks nested;
+  Stacks &stacks {shared.busy ? nested : shared};
+
+  // Released on the way out, also when visit() throws
+  struct Claim {
+    Stacks &stacks;
+
+    explicit Claim(Stacks &stacks) : stacks {stacks} { stacks.busy = true; }
+    ~Claim() { stacks.busy = false; }
+  } claim {stacks};
+
+  std::vector<Frame> &frames {stacks.frames};
+  std::vector<Index> &dependencies {stacks.dependencies};
+
+  frames.clear();
+  dependencies.clear();
+
+  auto open = [&](Index index) {
+    std::size_t begin {dependencies.size()};
+
+    operands(index, dependencies);
+    frames.push_back(Frame {index, begin, begin, dependencies.size()});
+  };
+
+  if (!done(root)) open(root);
+
+  while (!frames.empty()) {
+    Frame &top {frames.back()};
+
+    if (top.next < top.end) {
+      Index operand {dependencies[top.next++]};
+
+      if (operand != Pool::None && !done(operand)) open(operand);
+      continue;
+    }
+
+    Index index {top.index};
+
+    dependencies.resize(top.begin);
+    frames.pop_back();
+    visit(index);
+  }
+}
+
+template <typename T>
+template <typename Done, typename Visit>
+void Expression<T>::postOrder(const Pool &pool, Index root, Done done,
+                              Visit visit) {
+  auto children = [&pool](Index index, std::vector<Index> &operands) {
+    const Node &node {pool[index]};
+
+    // Leaves have neither, unary operations no right operand
+    if (node.leftExpr != Pool::None) operands.push_back(node.leftExpr);
+    if (node.rightExpr != Pool::None) operands.push_back(node.rightExpr);
+  };
+
+  postOrder(root, children, done, visit);
+}
+
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::copy(Pool &to, const Pool &from, Index root,
+                    std::vector<Index> &memo) {
+  auto copied = [&memo](Index index) { return memo[index] != Pool::None; };
+
+  postOrder(from, root, copied, [&](Index index) {
+    const Node &node {from[index]};
+
+    if (node.operation == Pool::Value) memo[index] = to.value(node.val);
+    else if (node.operation == Pool::Variable)
+      memo[index] = to.variable(from.symbol(node.symbol));
+    else
+      memo[index] = to.node(memo[node.leftExpr], node.operation,
+                            node.rightExpr != Pool::None
+                              ? memo[node.rightExpr] : Pool::None);
+  });
+
+  return memo[root];
+}
 
 template <typename T>
 Expression<T> Expression<T>::operator+(const Expression<T> &other) const {
-  return Expression(std::make_shared<Expression<T>>(*this), '+',
-                    std::make_shared<Expression<T>>(other));
+  return make('+', other);
 }
 
 template <typename T>
 Expression<T> Expression<T>::operator-(const Expression<T> &other) const {
-  return Expression(std::make_shared<Expression<T>>(*this), '-',
-                    std::make_shared<Expression<T>>(other));
+  return make('-', other);
 }
 
 template <typename T>
 Expression<T> Expression<T>::operator*(const Expression<T> &other) const {
-  return Expression(std::make_shared<Expression<T>>(*this), '*',
-                    std::make_shared<Expression<T>>(other));
+  return make('*', other);
 }
 
 template <typename T>
 Expression<T> Expression<T>::operator/(const Expression<T> &other) const {
-  return Expression(std::make_shared<Expression<T>>(*this), '/',
-                    std::make_shared<Expression<T>>(other));
+  return make('/', other);
 }
 
 template <typename T>
 Expression<T> Expression<T>::operator^(const Expression<T> &other) const {
-  return Expression(std::make_shared<Expression<T>>(*this), '^',
-                    std::make_shared<Expression<T>>(other));
+  return make('^', other);
 }
 
 template <typename T> Expression<T> Expression<T>::operator-() const {
-  if (m_isVal) return Expression<T>(-m_val);
+  return make(negate(*m_pool, m_index));
+}
 
-  if (m_isVar)
-    return Expression(
-      std::make_shared<Expression<T>>(*this), '*',
-      std::make_shared<Expression<T>>(T(-1))
-    );
+template <typename T>
+typename Expression<T>::Index Expression<T>::negate(Pool &pool, Index index) {
+  const Node &node {pool[index]};
+
+  if (node.operation == Pool::Value) return pool.value(-node.val);
 
-  return Expression(
-    std::make_shared<Expression<T>>(*this), '*',
-    std::make_shared<Expression<T>>(T(-1))
-  );
+  return pool.node(index, '*', pool.value(T(-1)));
 }
 
 template <typename T>
 bool Expression<T>::operator==(const Expression<T> &other) const {
-  if (this->m_isVal && other.m_isVal)
-    return this->m_val == other.m_val;
+  if (m_pool == other.m_pool) return m_index == other.m_index;
 
-  if (this->m_isVar && other.m_isVar)
-    return this->m_var == other.m_var;
+  return equal(*m_pool, m_index, *other.m_pool, other.m_index);
+}
 
-  if ((this->m_isVal && other.m_isVar) || (this->m_isVar && other.m_isVal)) {
-    return false;
-  }
+template <typename T>
+bool Expression<T>::equal(const Pool &a, Index left, const Pool &b,
+                          Index right) {
+  // Left operands are followed directly, right ones wait on `pending`
+  std::vector<std::pair<Index, Index>> pending;
+
+  for (;;) {
+    if (left == Pool::None || right == Pool::None) {
+      if (left != right) return false;
+    } else {
+      const Node &leftNode {a[left]}, &rightNode {b[right]};
+
+      if (leftNode.operation != rightNode.operation ||
+          leftNode.digest != rightNode.digest)
+        return false;
+
+      if (leftNode.operation == Pool::Value) {
+        if (leftNode.val != rightNode.val &&
+            !(std::isnan(leftNode.val) && std::isnan(rightNode.val)))
+          return false;
+      } else if (leftNode.operation == Pool::Variable) {
+        if (a.symbol(leftNode.symbol) != b.symbol(rightNode.symbol))
+          return false;
+      } else {
+        pending.push_back({leftNode.rightExpr, rightNode.rightExpr});
+        left = leftNode.leftExpr;
+        right = rightNode.leftExpr;
+        continue;
+      }
+    }
 
-  if (!this->m_isVal && !this->m_isVar) {
-    if (this->m_operation != other.m_operation)
-      return false;
+    if (pending.empty()) return true;
 
-    return (*this->m_leftExpr == *other.m_leftExpr) &&
-           (*this->m_rightExpr == *other.m_rightExpr);
+    left = pending.back().first;
+    right = pending.back().second;
+    pending.pop_back();
   }
-
-  return false;
 }
 
 template <typename T>
 Expression<T> Expression<T>::sin(const Expression<T> &expr) {
-  return Expression(std::make_shared<Expression<T>>(expr), 's', nullptr);
+  return Expression(expr, 's');
 }
 
 template <typename T>
 Expression<T> Expression<T>::cos(const Expression<T> &expr) {
-  return Expression(std::make_shared<Expression<T>>(expr), 'c', nullptr);
+  return Expression(expr, 'c');
 }
 
 template <typename T>
 Expression<T> Expression<T>::ln(const Expression<T> &expr) {
-  return Expression(std::make_shared<Expression<T>>(expr), 'l', nullptr);
+  return Expression(expr, 'l');
 }
 
 template <typename T>
 Expression<T> Expression<T>::exp(const Expression<T> &expr) {
-  return Expression(std::make_shared<Expression<T>>(expr), 'e', nullptr);
+  return Expression(expr, 'e');
 }
 
 template <typename T>
 Expression<T> Expression<T>::substitute(const std::string &var, T val) const {
-  if (m_isVal)
-    return m_val;
+  std::vector<Index> memo(m_pool->size(), Pool::None);
 
-  if (m_isVar)
-    return (m_var == var) ? Expression<T>(val) : *this;
-
-  auto leftSubstitute{m_leftExpr->substitute(var, val)},
-      rightSubstitute{m_rightExpr->substitute(var, val)};
+  return make(substitute(*m_pool, m_index, m_pool->findSymbol(var), val,
+                         memo));
+}
 
-  return Expression<T>(std::make_shared<Expression<T>>(leftSubstitute),
-                       m_operation,
-                       std::make_shared<Expression<T>>(rightSubstitute));
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::substitute(Pool &pool, Index root, std::uint32_t var, T val,
+                          std::vector<Index> &memo) {
+  auto substituted = [&memo](Index index) {
+    return memo[index] != Pool::None;
+  };
+
+  postOrder(pool, root, substituted, [&](Index index) {
+    Node node {pool[index]};
+
+    if (node.operation == Pool::Value) memo[index] = index;
+    else if (node.operation == Pool::Variable)
+      memo[index] = (node.symbol == var) ? pool.value(val) : index;
+    else
+      memo[index] = pool.node(memo[node.leftExpr], node.operation,
+                              node.rightExpr != Pool::None
+                                ? memo[node.rightExpr] : Pool::None);
+  });
+
+  return memo[root];
 }
 
 template <typename T>
 T Expression<T>::evaluate(const std::map<std::string, T> &context) const {
-  if (m_isVal) return m_val;
+  return evaluate(*m_pool, m_index, context);
+}
+
+// Walks the tree in post-order from an explicit stack of the operations
+// whose operands are still being evaluated, flagged once their right
+// operand is underway. Operand values are on top of `values` when an
+// operation is applied. Every result is also kept in `memo`, and a node
+// stamped in this call is not walked again but read from there, so shared
+// subexpressions are evaluated once and the buffers never need clearing.
+// Nothing in here can call back into evaluate(), so they are kept per thread
+// rather than allocated on every call
+template <typename T>
+T Expression<T>::evaluate(const Pool &pool, Index index,
+                          const std::map<std::string, T> &context) {
+  static thread_local std::vector<std::pair<Index, bool>> pending;
+  static thread_local std::vector<T> values, memo;
+  static thread_local std::vector<std::uint32_t> stamps;
+  static thread_local std::uint32_t stamp {0};
+
+  pending.clear();
+  values.clear();
+
+  if (stamps.size() < pool.size()) {
+    memo.resize(pool.size());
+    stamps.resize(pool.size(), 0);
+  }
+
+  if (++stamp == 0) {
+    std::fill(stamps.begin(), stamps.end(), 0);
+    stamp = 1;
+  }
+
+  for (;;) {
+    // Down the left operands to a leaf or a node evaluated already
+    const Node *node {&pool[index]};
 
-  if (m_isVar) {
-    auto it {context.find(m_var)};
+    for (; stamps[index] != stamp && node->operation != Pool::Value &&
+           node->operation != Pool::Variable;
+         node = &pool[index]) {
+      pending.push_back({index, false});
+      index = node->leftExpr;
+    }
+
+    if (stamps[index] == stamp) values.push_back(memo[index]);
+    else if (node->operation == Pool::Value) values.push_back(node->val);
+    else {
+      auto it {context.find(pool.symbol(node->symbol))};
 
-    if (it != context.end()) return it->second;
+      if (it == context.end()) throw std::runtime_error("Variable not found");
+
+      values.push_back(it->second);
+      memo[index] = it->second;
+      stamps[index] = stamp;
+    }
 
-    throw std::runtime_error("Variable not found");
+    // Up through every operation whose operands are all done
+    for (;;) {
+      if (pending.empty()) return values.back();
+
+      std::pair<Index, bool> &top {pending.back()};
+      const Node &operation {pool[top.first]};
+      bool unary {operation.rightExpr == Pool::None};
+
+      if (!unary && !top.second) {
+        top.second = true;
+        index = operation.rightExpr;
+        break;
+      }
+
+      Index done {top.first};
+      pending.pop_back();
+
+      T rightVal {unary ? T(0) : values.back()};
+      if (!unary) values.pop_back();
+
+      T leftVal {values.back()};
+      T &result {values.back()};
+
+      switch (operation.operation) {
+        case '-': result = unary ? -leftVal : leftVal - rightVal; break;
+        case '+': result = leftVal + rightVal; break;
+        case '*': result = leftVal * rightVal; break;
+        case '/':
+          if (rightVal == 0) throw std::runtime_error("Division by zero");
+          result = leftVal / rightVal;
+          break;
+
+        case '^': result = std::pow(leftVal, rightVal); break;
+        case 's': result = std::sin(leftVal); break;
+        case 'c': result = std::cos(leftVal); break;
+        case 'l':
+          if (!(leftVal > 0))
+            throw std::runtime_error("Invalid argument for ln()");
+          result = std::log(leftVal);
+          break;
+
+        case 'e': result = std::exp(leftVal); break;
+        default: throw std::runtime_error("Unknown operator");
+      }
+
+      memo[done] = result;
+      stamps[done] = stamp;
+    }
   }
+}
 
-  T leftVal {m_leftExpr->evaluate(context)},
-    rightVal {m_rightExpr ? m_rightExpr->evaluate(context) : T(0)};
+template <typename T>
+std::size_t
+Expression<T>::evaluateBatch(const std::map<std::string, const T *> &columns,
+                             std::size_t rows, T *result, std::uint8_t *errors,
+                             ThreadPool *pool) const {
+  CompiledExpression<T> program {compile()};
+  std::vector<const T *> slots;
+
+  for (const std::string &var : program.variables()) {
+    auto it {columns.find(var)};
+
+    if (it == columns.end()) throw std::runtime_error("Variable not found");
+    slots.push_back(it->second);
+  }
 
-  switch (m_operation) {
-    case '-':
-      if (!m_rightExpr) return -leftVal;
-      return leftVal - rightVal;
+  return program.evaluateBatch(slots.data(), rows, result, errors, pool);
+}
 
-    case '+': return leftVal + rightVal;
-    case '*': return leftVal * rightVal;
-    case '/':
-      if (rightVal != 0) return leftVal / rightVal;
-      throw std::runtime_error("Division by zero");
-
-    case '^': return std::pow(leftVal, rightVal);
-    case 's': return std::sin(leftVal);
-    case 'c': return std::cos(leftVal);
-    case 'l':
-      if (leftVal > 0) return std::log(leftVal);
-      throw std::runtime_error("Invalid argument for ln()");
-
-    case 'e': return std::exp(leftVal);
-    default: throw std::runtime_error("Unknown operator");
+template <typename T> std::size_t Expression<T>::nodeCount() const {
+  std::vector<std::size_t> counts(m_pool->size(), 0);
+  return nodeCount(*m_pool, m_index, counts);
+}
+
+template <typename T>
+std::size_t Expression<T>::nodeCount(const Pool &pool, Index root,
+                                     std::vector<std::size_t> &counts) {
+  auto counted = [&counts](Index index) { return counts[index] != 0; };
+
+  postOrder(pool, root, counted, [&](Index index) {
+    const Node &node {pool[index]};
+    std::size_t count {1};
+
+    if (node.operation != Pool::Value && node.operation != Pool::Variable) {
+      count += counts[node.leftExpr];
+
+      if (node.rightExpr != Pool::None) count += counts[node.rightExpr];
+    }
+
+    counts[index] = count;
+  });
+
+  return counts[root];
+}
+
+template <typename T> std::size_t Expression<T>::uniqueNodeCount() const {
+  std::vector<bool> seen(m_pool->size(), false);
+  std::vector<Index> pending {m_index};
+  std::size_t count {0};
+
+  while (!pending.empty()) {
+    Index index {pending.back()};
+    pending.pop_back();
+
+    if (index == Pool::None || seen[index]) continue;
+
+    seen[index] = true;
+    ++count;
+
+    const Node &node {(*m_pool)[index]};
+
+    if (node.operation != Pool::Value && node.operation != Pool::Variable) {
+      pending.push_back(node.leftExpr);
+      pending.push_back(node.rightExpr);
+    }
   }
+
+  return count;
+}
+
+template <typename T>
+const std::shared_ptr<typename Expression<T>::Pool> &
+Expression<T>::pool() const {
+  return m_pool;
+}
+
+template <typename T> CompiledExpression<T> Expression<T>::compile() const {
+  CompiledExpression<T> program;
+  compileInto(*m_pool, m_index, program, false);
+
+  return program;
+}
+
+template <typename T>
+CompiledExpression<T>
+Expression<T>::compile(const std::vector<std::string> &variables) const {
+  CompiledExpression<T> program;
+
+  for (const std::string &var : variables) program.addSlot(var);
+  compileInto(*m_pool, m_index, program, true);
+
+  return program;
+}
+
+// Emits each distinct node once, after its operands. `positions` maps a
+// node to the tape position holding its value, so every further use of a
+// shared subexpression just refers back to it
+template <typename T>
+void Expression<T>::compileInto(const Pool &pool, Index root,
+                                CompiledExpression<T> &program,
+                                bool fixedSlots) {
+  const std::uint32_t missing {0xffffffffu};
+  std::vector<std::uint32_t> positions(pool.size(), missing);
+
+  auto emitted = [&](Index index) { return positions[index] != missing; };
+
+  postOrder(pool, root, emitted, [&](Index index) {
+    const Node &node {pool[index]};
+    std::uint32_t &position {positions[index]};
+
+    if (node.operation == Pool::Value) {
+      position = program.emitConstant(node.val);
+      return;
+    }
+
+    if (node.operation == Pool::Variable) {
+      const std::string &var {pool.symbol(node.symbol)};
+
+      if (fixedSlots && program.slotOf(var) == program.slotCount())
+        throw std::runtime_error("Variable not found");
+
+      position = program.emitLoad(program.addSlot(var));
+      return;
+    }
+
+    if (node.leftExpr == Pool::None)
+      throw std::runtime_error("Invalid operation");
+
+    std::uint32_t left {positions[node.leftExpr]};
+
+    if (node.rightExpr != Pool::None) {
+      std::uint32_t right {positions[node.rightExpr]};
+
+      switch (node.operation) {
+        case '+': position = program.emit(OpCode::Add, left, right); return;
+        case '-': position = program.emit(OpCode::Sub, left, right); return;
+        case '*': position = program.emit(OpCode::Mul, left, right); return;
+        case '/': position = program.emit(OpCode::Div, left, right); return;
+        case '^': position = program.emit(OpCode::Pow, left, right); return;
+        default: throw std::runtime_error("Unknown operator");
+      }
+    }
+
+    switch (node.operation) {
+      case '+': position = left; return;
+      case '-': position = program.emit(OpCode::Neg, left); return;
+      case 's': position = program.emit(OpCode::Sin, left); return;
+      case 'c': position = program.emit(OpCode::Cos, left); return;
+      case 'l': position = program.emit(OpCode::Ln, left); return;
+      case 'e': position = program.emit(OpCode::Exp, left); return;
+      default: throw std::runtime_error("Unknown operator");
+    }
+  });
+
+  program.finish(positions[root]);
 }
 
 template <typename T> std::string Expression<T>::toString() const {
-  if (m_isVal) {
-    std::ostringstream ss;
+  return toString(*m_pool, m_index);
+}
 
-    if (std::floor(m_val) == m_val) ss << static_cast<int>(m_val);
-    else ss << m_val;
+// Appends to one string from an explicit stack of pieces still to write,
+// either a node or the literal text around its operands
+template <typename T>
+std::string Expression<T>::toString(const Pool &pool, Index index) {
+  struct Piece {
+    Index index;
+    const char *text;
+  };
+
+  std::vector<Piece> pending {{index, nullptr}};
+  std::string result;
+
+  while (!pending.empty()) {
+    Piece next {pending.back()};
+    pending.pop_back();
+
+    if (next.text) {
+      result += next.text;
+      continue;
+    }
 
-    return ss.str();
-  }
+    const Node &node {pool[next.index]};
+
+    if (node.operation == Pool::Value) {
+      std::ostringstream ss;
+
+      if (std::floor(node.val) == node.val) ss << static_cast<int>(node.val);
+      else ss << node.val;
+
+      result += ss.str();
+      continue;
+    }
+
+    if (node.operation == Pool::Variable) {
+      result += pool.symbol(node.symbol);
+      continue;
+    }
+
+    const char *open {"("}, *middle {nullptr}, *close {")"};
+
+    switch (node.operation) {
+      case '+': open = close = ""; middle = " + "; break;
+      case '-': open = close = ""; middle = " - "; break;
+      case '*': middle = ")*("; break;
+      case '/': middle = ")/("; break;
+      case '^': middle = ")^("; break;
+      case 's': open = "sin("; break;
+      case 'c': open = "cos("; break;
+      case 'l': open = "ln("; break;
+      case 'e': open = "exp("; break;
+      default: continue;
+    }
+
+    // Pushed in reverse, the top of the stack is written first
+    pending.push_back({Pool::None, close});
+
+    if (middle) {
+      if (node.rightExpr != Pool::None)
+        pending.push_back({node.rightExpr, nullptr});
+      pending.push_back({Pool::None, middle});
+    }
 
-  if (m_isVar) return m_var;
-
-  std::string leftString{m_leftExpr->toString()},
-              rightString{m_rightExpr ? m_rightExpr->toString() : ""};
-
-  switch (m_operation) {
-    case '+': return leftString + " + " + rightString;
-    case '-': return leftString + " - " + rightString;
-    case '*': return "(" + leftString + ")" + "*" + "(" + rightString + ")";
-    case '/': return "(" + leftString + ")" + "/" + "(" + rightString + ")";
-    case '^': return "(" + leftString + ")" + "^" + "(" + rightString + ")";
-    case 's': return "sin(" + leftString + ")";
-    case 'c': return "cos(" + leftString + ")";
-    case 'l': return "ln(" + leftString + ")";
-    case 'e': return "exp(" + leftString + ")";
-    default: return "";
+    pending.push_back({node.leftExpr, nullptr});
+    pending.push_back({Pool::None, open});
   }
+
+  return result;
 }
 
 template <typename T>
 Expression<T> Expression<T>::derivative(const std::string &var) const {
-  if (m_isVal) return Expression<T>(0);
+  std::vector<Index> memo(m_pool->size(), Pool::None);
+
+  return make(derivative(*m_pool, m_index, m_pool->findSymbol(var), memo));
+}
+
+// Operands are derived before the operations using them. New nodes may
+// reallocate the pool, so nodes are copied out before building anything
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::derivative(Pool &pool, Index root, std::uint32_t var,
+                          std::vector<Index> &memo) {
+  auto build = [&pool](Index leftExpr, char op, Index rightExpr) {
+    return Expression<T>::build(pool, leftExpr, op, rightExpr);
+  };
+
+  auto derive = [&](Index index) -> Index {
+    Node node {pool[index]};
+
+    if (node.operation == Pool::Value) return pool.value(0);
+
+    if (node.operation == Pool::Variable) {
+      if (node.symbol == var) return pool.value(1);
+      return pool.value(0);
+    }
+
+    if (node.leftExpr == Pool::None)
+      throw std::runtime_error("Invalid operation");
+
+    Node left {pool[node.leftExpr]};
+    Index l {node.leftExpr}, r {node.rightExpr};
+
+    bool leftIsVar{left.operation == Pool::Variable && left.symbol == var},
+         leftIsVal{left.operation == Pool::Value},
+         leftIsExpr {left.leftExpr != Pool::None};
+
+    Index leftDerivative {memo[l]};
+
+    switch (node.operation) {
+      case '+':
+        if (r == Pool::None) return leftDerivative;
+        return build(leftDerivative, '+', memo[r]);
+
+      case '-':
+        if (r == Pool::None) return negate(pool, leftDerivative);
+        return build(leftDerivative, '-', memo[r]);
+
+      case '*':
+        if (r == Pool::None) throw std::runtime_error("Missing operand for *");
+        return build(build(leftDerivative, '*', r), '+',
+                     build(l, '*', memo[r]));
 
-  if (m_isVar) {
-    if (m_var == var) return Expression<T>(1);
-    return Expression<T>(0);
+      case '/':
+        if (r == Pool::None) throw std::runtime_error("Missing operand for /");
+        return build(build(build(leftDerivative, '*', r), '-',
+                           build(l, '*', memo[r])),
+                     '/', build(r, '*', r));
+
+      case '^': {
+        if (r == Pool::None) throw std::runtime_error("Missing operand for ^");
+
+        Node right {pool[r]};
+        bool rightIsVar {right.operation == Pool::Variable &&
+                         right.symbol == var},
+             rightIsVal {right.operation == Pool::Value},
+             rightIsExpr {right.leftExpr != Pool::None};
+
+        // const ^ const
+        if (leftIsVal && rightIsVal) return pool.value(0);
+
+        // expr ^ const
+        if (!rightIsVar && !rightIsExpr) {
+          Index exponent{build(r, '-', pool.value(1))};
+          return build(build(r, '*', build(l, '^', exponent)), '*',
+                       leftDerivative);
+        }
+
+        // const ^ (x / expr)
+        if ((!leftIsVar && !leftIsExpr) && (rightIsExpr || rightIsVar)) {
+          return build(build(index, '*', memo[r]), '*',
+                       pool.node(l, 'l'));
+        }
+
+        // (expr/x) ^ (expr/x)
+        if ((leftIsExpr || leftIsVar) && (rightIsExpr || rightIsVar))
+          return build(index, '*',
+                       build(build(memo[r], '*', pool.node(l, 'l')), '+',
+                             build(build(r, '*', leftDerivative), '/', l)));
+
+        throw std::runtime_error("Unknown operands for ^");
+      }
+
+      case 's': return build(pool.node(l, 'c'), '*', leftDerivative);
+      case 'c':
+        return build(negate(pool, pool.node(l, 's')), '*', leftDerivative);
+      case 'l': return build(leftDerivative, '/', l);
+      case 'e': return build(pool.node(l, 'e'), '*', leftDerivative);
+    }
+
+    throw std::runtime_error(
+        "Derivative calculation failed due to unknown operation"
+    );
+  };
+
+  auto derived = [&memo](Index index) { return memo[index] != Pool::None; };
+
+  postOrder(pool, root, derived,
+            [&](Index index) { memo[index] = derive(index); });
+
+  return memo[root];
+}
+
+template <typename T>
+Gradient<T>
+Expression<T>::gradient(const std::map<std::string, T> &context) const {
+  CompiledExpression<T> program {compile()};
+  std::vector<T> slots, partials;
+
+  for (const std::string &var : program.variables()) {
+    auto it {context.find(var)};
+
+    if (it == context.end()) throw std::runtime_error("Variable not found");
+    slots.push_back(it->second);
   }
 
-  if (!m_leftExpr) throw std::runtime_error("Invalid operation");
+  Gradient<T> result;
+  result.value = program.gradient(slots, partials);
 
-  bool leftIsVar{m_leftExpr->m_isVar && m_leftExpr->m_var == var},
-       leftIsVal{m_leftExpr->m_isVal}, leftIsExpr {m_leftExpr->m_leftExpr};
+  for (std::size_t slot {0}; slot < partials.size(); ++slot)
+    result.partials[program.variables()[slot]] = partials[slot];
 
-  Expression<T> leftDerivative{m_leftExpr->derivative(var)};
+  return result;
+}
 
-  switch (m_operation) {
+template <typename T>
+Expression<T> Expression<T>::fromString(const std::string &exprString) {
+  parser::Parser<T> parser;
+  return parser.parse(exprString.data(), exprString.size());
+}
+
+template <typename T> Expression<T> Expression<T>::simplify() const {
+  Index index {m_index};
+
+  // Each pass can expose new opportunities to the next one (a folded
+  // constant, a freshly merged power); hash-consing makes "nothing changed"
+  // an index comparison
+  for (int pass {0}; pass < 32; ++pass) {
+    std::vector<Index> memo(m_pool->size(), Pool::None);
+    Index simplified {canonicalize(*m_pool, index, memo)};
+
+    if (simplified == index) break;
+    index = simplified;
+  }
+
+  return make(index);
+}
+
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::build(Pool &pool, Index leftExpr, char operation,
+                     Index rightExpr) {
+  Node left {pool[leftExpr]}, right {pool[rightExpr]};
+
+  bool leftIsVal {left.operation == Pool::Value},
+       rightIsVal {right.operation == Pool::Value};
+  T leftVal {leftIsVal ? left.val : T(0)},
+    rightVal {rightIsVal ? right.val : T(0)};
+
+  switch (operation) {
     case '+':
-      if (!m_rightExpr) return leftDerivative;
-      return leftDerivative + m_rightExpr->derivative(var);
+      if (leftIsVal && rightIsVal) return pool.value(leftVal + rightVal);
+      if (leftIsVal && leftVal == 0) return rightExpr;
+      if (rightIsVal && rightVal == 0) return leftExpr;
+      break;
 
     case '-':
-      if (!m_rightExpr) return -leftDerivative;
-      return leftDerivative - m_rightExpr->derivative(var);
+      if (leftIsVal && rightIsVal) return pool.value(leftVal - rightVal);
+      if (rightIsVal && rightVal == 0) return leftExpr;
+      if (leftIsVal && leftVal == 0) return negate(pool, rightExpr);
+      break;
 
     case '*':
-      if (!m_rightExpr) throw std::runtime_error("Missing operand for *");
-      return leftDerivative * *m_rightExpr +
-             *m_leftExpr * m_rightExpr->derivative(var);
+      if (leftIsVal && rightIsVal) return pool.value(leftVal * rightVal);
+      if ((leftIsVal && leftVal == 0) || (rightIsVal && rightVal == 0))
+        return pool.value(0);
+      if (leftIsVal && leftVal == 1) return rightExpr;
+      if (rightIsVal && rightVal == 1) return leftExpr;
+
+      // Keep numeric factors together: c1 * (c2 * u) -> (c1 * c2) * u
+      if (leftIsVal && right.operation == '*' &&
+          pool[right.leftExpr].operation == Pool::Value)
+        return pool.node(pool.value(leftVal * pool[right.leftExpr].val), '*',
+                         right.rightExpr);
+      if (rightIsVal)
+        return build(pool, rightExpr, '*', leftExpr);
+      break;
 
     case '/':
-      if (!m_rightExpr) throw std::runtime_error("Missing operand for /");
-      return (leftDerivative * *m_rightExpr - *m_leftExpr *
-              m_rightExpr->derivative(var)) / (*m_rightExpr * *m_rightExpr);
+      if (rightIsVal && rightVal == 0) break;
+      if (leftIsVal && rightIsVal) return pool.value(leftVal / rightVal);
+      if (leftIsVal && leftVal == 0) return pool.value(0);
+      if (rightIsVal && rightVal == 1) return leftExpr;
+      break;
+
+    case '^':
+      if (leftIsVal && rightIsVal)
+        return pool.value(std::pow(leftVal, rightVal));
+      if (rightIsVal && rightVal == 0) return pool.value(1);
+      if (rightIsVal && rightVal == 1) return leftExpr;
+      if (leftIsVal && leftVal == 1) return pool.value(1);
+      break;
+  }
 
-    case '^': {
-      if (!m_rightExpr) throw std::runtime_error("Missing operand for ^");
+  return pool.node(leftExpr, operation, rightExpr);
+}
 
-      bool rightIsVar {m_rightExpr->m_isVar && m_rightExpr->m_var == var},
-           rightIsVal {m_rightExpr->m_isVal},
-           rightIsExpr {m_rightExpr->m_leftExpr};
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::canonicalize(Pool &pool, Index root,
+                            std::vector<Index> &memo) {
+  // A + or - chain depends on the right operands along its left spine and on
+  // whatever ends it, likewise for * and /. The partial chains in between are
+  // not canonicalized on their own: that would rebuild the sum at each level,
+  // which is quadratic in the length of the chain
+  auto chainOperands = [&pool](Index index, std::vector<Index> &operands) {
+    const Node &node {pool[index]};
+    bool sum {node.operation == '+' || node.operation == '-'},
+         product {node.operation == '*' || node.operation == '/'};
+
+    if (!sum && !product) {
+      operands.push_back(node.leftExpr);
+      operands.push_back(node.rightExpr);
+      return;
+    }
 
-      // const ^ const
-      if (leftIsVal && rightIsVal) return Expression<T>(0);
+    for (Index spine {index};; spine = pool[spine].leftExpr) {
+      const Node &link {pool[spine]};
 
-      // x ^ const
-      if (leftIsVar && (!rightIsVar && !rightIsExpr)) {
-        Expression<T> exponent{*m_rightExpr - Expression<T>(1)};
-        return *m_rightExpr * (*m_leftExpr ^ (exponent)) * leftDerivative;
+      if (sum ? link.operation != '+' && link.operation != '-'
+              : link.operation != '*' && link.operation != '/') {
+        operands.push_back(spine);
+        return;
       }
 
-      // const ^ (x / expr)
-      if ((!leftIsVar && !leftIsExpr) && (rightIsExpr || rightIsVar)) {
-        return *this * m_rightExpr->derivative(var) * ln(*m_leftExpr);
+      operands.push_back(link.rightExpr);
+    }
+  };
+
+  auto canonical = [&](Index index) -> Index {
+    Node node {pool[index]};
+
+    if (node.operation == Pool::Value || node.operation == Pool::Variable)
+      return index;
+
+    std::vector<Term> terms;
+    T constant {0}, coefficient {1};
+
+    // Chains such as a + b - c + ... are collected along their left spine in
+    // one go, see chainOperands
+    if (node.operation == '+' || node.operation == '-') {
+      Index spine {index};
+      T sign {1};
+
+      for (Node link {node};; link = pool[spine]) {
+        if (link.operation != '+' && link.operation != '-') {
+          collectTerms(pool, memo[spine], sign, terms, constant);
+          break;
+        }
+
+        if (link.rightExpr == Pool::None) {
+          if (link.operation == '-') sign = -sign;
+        } else {
+          collectTerms(pool, memo[link.rightExpr],
+                       link.operation == '-' ? -sign : sign, terms, constant);
+        }
+
+        spine = link.leftExpr;
       }
 
-      // (expr/x) ^ (expr/x)
-      if ((leftIsExpr || leftIsVar) && (rightIsExpr || rightIsVar))
-        return *this * (m_rightExpr->derivative(var) * (ln(*m_leftExpr) +
-               *m_rightExpr * leftDerivative / *m_leftExpr));
+      return buildSum(pool, terms, constant);
+    }
+
+    if (node.operation == '*' || node.operation == '/') {
+      Index spine {index};
+
+      for (Node link {node};; link = pool[spine]) {
+        if (link.operation != '*' && link.operation != '/') {
+          collectFactors(pool, memo[spine], T(1), terms, coefficient);
+          break;
+        }
+
+        if (link.rightExpr == Pool::None)
+          throw std::runtime_error("Missing operand for " +
+                                   std::string(1, link.operation));
+
+        collectFactors(pool, memo[link.rightExpr],
+                       link.operation == '/' ? T(-1) : T(1), terms,
+                       coefficient);
+        spine = link.leftExpr;
+      }
 
-      throw std::runtime_error("Unknown operands for ^");
+      return buildProduct(pool, terms, coefficient);
     }
 
-    case 's':
-      if (m_leftExpr) return cos(*m_leftExpr) * leftDerivative;
-      throw std::runtime_error("Missing argument for sin");
+    Index leftIndex {memo[node.leftExpr]},
+          rightIndex {node.rightExpr != Pool::None ? memo[node.rightExpr]
+                                                   : Pool::None};
+    Node leftSimplified {pool[leftIndex]};
+    bool leftIsVal {leftSimplified.operation == Pool::Value};
+
+    switch (node.operation) {
+      case '^': {
+        if (rightIndex == Pool::None)
+          throw std::runtime_error("Missing operand for ^");
+
+        Node rightSimplified {pool[rightIndex]};
+
+        if (rightSimplified.operation != Pool::Value) {
+          if (leftIsVal &&
+              (leftSimplified.val == 0 || leftSimplified.val == 1))
+            return leftIndex;
+
+          return pool.node(leftIndex, '^', rightIndex);
+        }
+
+        T exponent {rightSimplified.val};
+
+        if (leftIsVal)
+          return pool.value(std::pow(leftSimplified.val, exponent));
+        if (exponent == 0) return pool.value(1);
+
+        // (u ^ a) ^ b -> u ^ (a * b), for integer b only: (x ^ 2) ^ 0.5 is
+        // |x|, not x
+        if (leftSimplified.operation == '^' &&
+            pool[leftSimplified.rightExpr].operation == Pool::Value &&
+            std::floor(exponent) == exponent)
+          terms.push_back(
+            Term {leftSimplified.leftExpr,
+                  pool[leftSimplified.rightExpr].val * exponent}
+          );
+        else terms.push_back(Term {leftIndex, exponent});
+
+        return buildProduct(pool, terms, coefficient);
+      }
 
-    case 'c':
-      if (m_leftExpr) return -sin(*m_leftExpr) * leftDerivative;
-      throw std::runtime_error("Missing argument for cos");
+      case 's':
+        if (leftIsVal && leftSimplified.val == 0) return pool.value(0);
+        break;
 
-    case 'l':
-      if (m_leftExpr)  return Expression<T>(1) / leftDerivative;
-      throw std::runtime_error("Missing argument for ln");
+      case 'c':
+        if (leftIsVal && leftSimplified.val == 0) return pool.value(1);
+        break;
 
-    case 'e':
-      if (m_leftExpr) return exp(*m_leftExpr) * leftDerivative;
-      throw std::runtime_error("Missing argument for exp");
-  }
+      case 'l':
+        if (leftIsVal && leftSimplified.val == 1) return pool.value(0);
+        if (leftSimplified.operation == 'e') return leftSimplified.leftExpr;
+        break;
+
+      case 'e':
+        if (leftIsVal && leftSimplified.val == 0) return pool.value(1);
+        break;
+    }
 
-  throw std::runtime_error(
-      "Derivative calculation failed due to unknown operation"
-  );
+    return pool.node(leftIndex, node.operation, rightIndex);
+  };
+
+  auto canonicalized = [&memo](Index index) {
+    return memo[index] != Pool::None;
+  };
+
+  postOrder(root, chainOperands, canonicalized,
+            [&](Index index) { memo[index] = canonical(index); });
+
+  return memo[root];
 }
 
+// Terms of a canonical sum are `c * rest` with the numeric coefficient on
+// the left, so splitting one off is a single check
 template <typename T>
-Expression<T> Expression<T>::fromString(const std::string &exprString) {
-  std::vector<Token> tokens{parser::tokenize(exprString)};
-  return parser::parseExpression<T>(tokens);
-}
+void Expression<T>::collectTerms(Pool &pool, Index index, T sign,
+                                 std::vector<Term> &terms, T &constant) {
+  auto isSum = [&pool](Index term) {
+    const Node &node {pool[term]};
+
+    return (node.operation == '+' && node.rightExpr != Pool::None) ||
+           node.operation == '-';
+  };
+
+  auto collect = [&](Index term, T termSign) {
+    Node node {pool[term]};
+
+    if (node.operation == Pool::Value) constant += termSign * node.val;
+    else if (node.operation == '*' &&
+             pool[node.leftExpr].operation == Pool::Value)
+      terms.push_back(Term {node.rightExpr,
+                            termSign * pool[node.leftExpr].val});
+    // c / u is kept in that shape for readability, its rest is 1 / u
+    else if (node.operation == '/' &&
+             pool[node.leftExpr].operation == Pool::Value &&
+             pool[node.leftExpr].val != 1) {
+      T numerator {pool[node.leftExpr].val};
+      Index denominator {node.rightExpr};
+
+      terms.push_back(Term {pool.node(pool.value(1), '/', denominator),
+                            termSign * numerator});
+    } else terms.push_back(Term {term, termSign});
+  };
+
+  // Sums are walked down their left operands. Right operands that are sums
+  // themselves wait on `pending` with their sign, the rest are collected on
+  // the spot, so canonical sums allocate nothing here
+  std::vector<std::pair<Index, T>> pending;
+
+  for (;;) {
+    if (isSum(index)) {
+      Node node {pool[index]};
+
+      if (node.rightExpr != Pool::None) {
+        T rightSign {node.operation == '-' ? -sign : sign};
+
+        if (isSum(node.rightExpr))
+          pending.push_back({node.rightExpr, rightSign});
+        else collect(node.rightExpr, rightSign);
+      }
 
-template <typename T> Expression<T> Expression<T>::simplify() const {
-  if (m_isVal || m_isVar) return *this;
+      index = node.leftExpr;
+      continue;
+    }
 
-  if (!m_leftExpr || !m_rightExpr)
-    return Expression<T>(m_leftExpr, m_operation, m_rightExpr);
+    collect(index, sign);
 
-  Expression<T> leftSimplified{m_leftExpr->simplify()},
-      rightSimplified{m_rightExpr->simplify()};
+    if (pending.empty()) return;
 
-  // Both operands are constants
-  if (leftSimplified.m_isVal && rightSimplified.m_isVal) {
-    T leftVal {leftSimplified.m_val}, rightVal {rightSimplified.m_val};
+    index = pending.back().first;
+    sign = pending.back().second;
+    pending.pop_back();
+  }
+}
 
-    switch (m_operation) {
-      case '+': return Expression<T>(leftVal + rightVal);
-      case '-': return Expression<T>(leftVal - rightVal);
-      case '*': return Expression<T>(leftVal * rightVal);
-      case '/':
-        if (rightVal == 0) throw std::runtime_error("Dividing by zero\n");
-        return Expression<T>(leftVal / rightVal);
+template <typename T>
+void Expression<T>::collectFactors(const Pool &pool, Index index, T power,
+                                   std::vector<Term> &factors,
+                                   T &coefficient) {
+  auto isProduct = [&pool](Index factor) {
+    const Node &node {pool[factor]};
 
-      case '^':
-        return Expression<T>(std::pow(leftVal, rightVal));
+    return node.operation == '*' || node.operation == '/' ||
+           (node.operation == '-' && node.rightExpr == Pool::None);
+  };
 
-      default: break;
+  auto collect = [&](Index factor, T factorPower) {
+    const Node &node {pool[factor]};
+
+    if (node.operation == Pool::Value) {
+      if (factorPower < 0 && node.val == 0)
+        throw std::runtime_error("Dividing by zero");
+
+      coefficient *= factorPower == 1 ? node.val
+                                      : std::pow(node.val, factorPower);
+    }
+    // Bases are not expanded: (x * y) ^ a is only x ^ a * y ^ a for some a
+    else if (node.operation == '^' &&
+             pool[node.rightExpr].operation == Pool::Value)
+      factors.push_back(Term {node.leftExpr,
+                              factorPower * pool[node.rightExpr].val});
+    else factors.push_back(Term {factor, factorPower});
+  };
+
+  // Same walk as collectTerms(): down the left operands, nested products on
+  // the right wait on `pending` with their power
+  std::vector<std::pair<Index, T>> pending;
+
+  for (;;) {
+    if (isProduct(index)) {
+      const Node &node {pool[index]};
+
+      if (node.operation == '-') coefficient = -coefficient;
+      else {
+        T rightPower {node.operation == '/' ? -power : power};
+
+        if (isProduct(node.rightExpr))
+          pending.push_back({node.rightExpr, rightPower});
+        else collect(node.rightExpr, rightPower);
+      }
+
+      index = node.leftExpr;
+      continue;
     }
+
+    collect(index, power);
+
+    if (pending.empty()) return;
+
+    index = pending.back().first;
+    power = pending.back().second;
+    pending.pop_back();
   }
+}
+
+template <typename T>
+void Expression<T>::mergeTerms(const Pool &pool, std::vector<Term> &terms) {
+  std::sort(terms.begin(), terms.end(),
+            [&pool](const Term &a, const Term &b) {
+              return compare(pool, a.rest, b.rest) < 0;
+            });
+
+  std::size_t merged {0};
+
+  for (std::size_t i {0}; i < terms.size(); ++i) {
+    if (merged && terms[merged - 1].rest == terms[i].rest)
+      terms[merged - 1].coefficient += terms[i].coefficient;
+    else terms[merged++] = terms[i];
+  }
+
+  terms.resize(merged);
+  terms.erase(std::remove_if(terms.begin(), terms.end(),
+                             [](const Term &term) {
+                               return term.coefficient == 0;
+                             }),
+              terms.end());
+}
+
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::buildSum(Pool &pool, std::vector<Term> &terms, T constant) {
+  mergeTerms(pool, terms);
+
+  auto scaled = [&pool](Index rest, T coefficient) {
+    if (coefficient == 1) return rest;
 
-  // Operands are the same variable
-  if (leftSimplified.m_isVar && rightSimplified.m_isVar &&
-      rightSimplified.m_var == leftSimplified.m_var) {
-    switch (m_operation) {
-      case '+': return leftSimplified * Expression<T>(2);
-      case '-': return Expression<T>(0);
-      case '*': return leftSimplified ^ Expression<T>(2);
-      case '/': return Expression<T>(1);
+    const Node &node {pool[rest]};
+
+    if (node.operation == '/' && pool[node.leftExpr].operation == Pool::Value &&
+        pool[node.leftExpr].val == 1) {
+      Index denominator {node.rightExpr};
+      return pool.node(pool.value(coefficient), '/', denominator);
     }
+
+    return pool.node(pool.value(coefficient), '*', rest);
+  };
+
+  // Lead with a positive term where there is one, so the sum reads a - b
+  // rather than -1 * b + a
+  std::stable_partition(terms.begin(), terms.end(), [](const Term &term) {
+    return term.coefficient > 0;
+  });
+
+  Index sum {Pool::None};
+
+  for (const Term &term : terms) {
+    if (sum == Pool::None) sum = scaled(term.rest, term.coefficient);
+    else if (term.coefficient < 0)
+      sum = pool.node(sum, '-', scaled(term.rest, -term.coefficient));
+    else sum = pool.node(sum, '+', scaled(term.rest, term.coefficient));
   }
 
-  // One of the operands is a constant, and the other is a variable
-  switch (m_operation) {
-  case '+':
-    if (leftSimplified.m_isVal && leftSimplified.m_val == 0)
-      return rightSimplified;
-    if (rightSimplified.m_isVal && rightSimplified.m_val == 0)
-      return leftSimplified;
-
-    break;
-
-  case '-':
-    if (leftSimplified.m_isVal && leftSimplified.m_val == 0)
-      return -rightSimplified;
-    if (rightSimplified.m_isVal && rightSimplified.m_val == 0)
-      return leftSimplified;
-
-    break;
-
-  case '*':
-    if (leftSimplified.m_isVal) {
-      if (leftSimplified.m_val == 1)
-        return rightSimplified;
-      if (leftSimplified.m_val == 0)
-        return Expression<T>(0);
+  if (sum == Pool::None) return pool.value(constant);
+  if (constant < 0) return pool.node(sum, '-', pool.value(-constant));
+  // NaN is neither positive nor negative, but dropping it would make an
+  // undefined sum evaluate to a number
+  if (constant != 0 || std::isnan(constant))
+    return pool.node(sum, '+', pool.value(constant));
+
+  return sum;
+}
+
+// Positive powers go to the numerator, negative ones to the denominator,
+// and the numeric coefficient in front: c * (num / den)
+template <typename T>
+typename Expression<T>::Index
+Expression<T>::buildProduct(Pool &pool, std::vector<Term> &factors,
+                            T coefficient) {
+  if (coefficient == 0) return pool.value(0);
+
+  mergeTerms(pool, factors);
+
+  auto power = [&pool](Index base, T exponent) {
+    return exponent == 1 ? base
+                         : pool.node(base, '^', pool.value(exponent));
+  };
+
+  Index numerator {Pool::None}, denominator {Pool::None};
+
+  for (const Term &factor : factors) {
+    Index &side {factor.coefficient > 0 ? numerator : denominator};
+    Index raised {power(factor.rest, std::abs(factor.coefficient))};
+
+    side = side == Pool::None ? raised : pool.node(side, '*', raised);
+  }
+
+  bool onlyDenominator {numerator == Pool::None && denominator != Pool::None};
+
+  if (denominator != Pool::None)
+    numerator = pool.node(numerator == Pool::None ? pool.value(1) : numerator,
+                          '/', denominator);
+
+  if (numerator == Pool::None) return pool.value(coefficient);
+  if (coefficient == 1) return numerator;
+
+  if (onlyDenominator)
+    return pool.node(pool.value(coefficient), '/', denominator);
+
+  return pool.node(pool.value(coefficient), '*', numerator);
+}
+
+template <typename T>
+int Expression<T>::compare(const Pool &pool, Index left, Index right) {
+  auto rank = [](char operation) {
+    switch (operation) {
+      case Pool::Value: return 0;
+      case Pool::Variable: return 1;
+      case '^': return 2;
+      case '*': return 3;
+      case '/': return 4;
+      case '+': return 5;
+      case '-': return 6;
+      default: return 7;
     }
+  };
+
+  // Left operands are compared first and followed directly, the right ones
+  // wait on `pending`. The first difference decides
+  std::vector<std::pair<Index, Index>> pending;
 
-    if (rightSimplified.m_isVal) {
-      if (rightSimplified.m_val == 1)
-        return leftSimplified;
-      if (rightSimplified.m_val == 0)
-        return Expression<T>(0);
+  for (;;) {
+    if (left == right) {
+      if (pending.empty()) return 0;
+
+      left = pending.back().first;
+      right = pending.back().second;
+      pending.pop_back();
+      continue;
     }
 
-    break;
+    if (left == Pool::None) return -1;
+    if (right == Pool::None) return 1;
 
-  case '/':
-    if (leftSimplified.m_isVal && leftSimplified.m_val == 0)
-      return Expression<T>(0);
-    if (rightSimplified.m_isVal && rightSimplified.m_val == 1)
-      return leftSimplified;
+    const Node &a {pool[left]}, &b {pool[right]};
 
-    break;
+    if (rank(a.operation) != rank(b.operation))
+      return rank(a.operation) < rank(b.operation) ? -1 : 1;
 
-  case '^':
-    if (rightSimplified.m_isVal)
-      if (rightSimplified.m_val == 0)
-        return Expression<T>(1);
-    if (rightSimplified.m_val == 1)
-      return leftSimplified;
+    // Distinct value nodes never hold equal values, and NaN has one node
+    // that sorts last, so this stays a strict weak ordering
+    if (a.operation == Pool::Value) {
+      if (std::isnan(a.val)) return 1;
+      if (std::isnan(b.val)) return -1;
 
-    if (leftSimplified.m_isVal) {
-      if (leftSimplified.m_val == 0)
-        return Expression<T>(0);
-      if (leftSimplified.m_val == 1)
-        return Expression<T>(1);
+      return a.val < b.val ? -1 : 1;
     }
-  }
 
-  return Expression<T>(std::make_shared<Expression<T>>(leftSimplified),
-                       m_operation,
-                       std::make_shared<Expression<T>>(rightSimplified));
+    if (a.operation == Pool::Variable)
+      return pool.symbol(a.symbol).compare(pool.symbol(b.symbol));
+
+    // Operations are ordered by digest first, which spares walking down long
+    // shared chains that only differ near the bottom
+    if (a.digest != b.digest) return a.digest < b.digest ? -1 : 1;
+    if (a.operation != b.operation) return a.operation < b.operation ? -1 : 1;
+
+    pending.push_back({a.rightExpr, b.rightExpr});
+    left = a.leftExpr;
+    right = b.leftExpr;
+  }
 }
 
 #endif // EXPRESSION_TPP
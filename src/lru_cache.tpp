@@ -0,0 +1,64 @@
+#ifndef LRU_CACHE_TPP
+#define LRU_CACHE_TPP
+
+#include "../include/lru_cache.hpp"
+
+template <typename K, typename V>
+LruCache<K, V>::LruCache(std::size_t capacity)
+    : m_capacity {capacity ? capacity : 1}, m_hits {0}, m_misses {0},
+      m_evictions {0} {}
+
+template <typename K, typename V>
+std::shared_ptr<V> LruCache<K, V>::get(const K &key) {
+  std::lock_guard<std::mutex> lock {m_mutex};
+
+  auto found {m_index.find(key)};
+
+  if (found != m_index.end()) {
+    ++m_hits;
+    m_items.splice(m_items.begin(), m_items, found->second);
+
+    return found->second->second;
+  }
+
+  ++m_misses;
+
+  if (m_items.size() >= m_capacity) {
+    m_index.erase(m_items.back().first);
+    m_items.pop_back();
+    ++m_evictions;
+  }
+
+  m_items.emplace_front(key, std::make_shared<V>());
+  m_index[key] = m_items.begin();
+
+  return m_items.front().second;
+}
+
+template <typename K, typename V> std::size_t LruCache<K, V>::size() const {
+  std::lock_guard<std::mutex> lock {m_mutex};
+  return m_items.size();
+}
+
+template <typename K, typename V>
+std::size_t LruCache<K, V>::capacity() const {
+  return m_capacity;
+}
+
+template <typename K, typename V> std::size_t LruCache<K, V>::hits() const {
+  std::lock_guard<std::mutex> lock {m_mutex};
+  return m_hits;
+}
+
+template <typename K, typename V> std::size_t LruCache<K, V>::misses() const {
+  std::lock_guard<std::mutex> lock {m_mutex};
+  return m_misses;
+}
+
+template <typename K, typename V>
+std::size_t LruCache<K, V>::evictions() const {
+  std::lock_guard<std::mutex> lock {m_mutex};
+  return m_evictions;
+}
+
+#endif // LRU_CACHE_TPP
@@ -1,9 +1,18 @@
 #include "../include/tests.hpp"
 
 #include "../include/expression.hpp"
+#include "../include/server.hpp"
+#include "../include/stats.hpp"
+#include "../include/thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 template <typename T>
 T evaluateExpr(const std::string &expr_str,
@@ -18,6 +27,19 @@ T evaluateExpr(const std::string &expr_str,
     }
 }
 
+template <typename T>
+Gradient<T> gradientExpr(const std::string &expr_str,
+                         const std::map<std::string, T> &context) {
+    try {
+        Expression<T> expr = Expression<T>::fromString(expr_str);
+
+        return expr.gradient(context);
+    } catch (const std::exception &e) {
+        std::cerr << "Error evaluating gradient: " << e.what() << " ";
+        return Gradient<T>{T(0), {}};
+    }
+}
+
 template <typename T>
 Expression<T> differentiateExpr(const std::string &expr_str,
                                 const std::string &var) {
@@ -31,13 +53,277 @@ Expression<T> differentiateExpr(const std::string &expr_str,
     }
 }
 
+// Parses var=value arguments starting at argv[first]
+bool readAssignments(int argc, char *argv[], int first,
+                     std::map<std::string, double> &context) {
+    for (int i = first; i < argc; ++i) {
+        std::string var_assignment{argv[i]};
+        size_t equal_pos{var_assignment.find('=')};
+
+        if (equal_pos == std::string::npos) {
+            std::cerr << "Error: Invalid variable assignment format\n";
+            return false;
+        }
+
+        std::string var_name{var_assignment.substr(0, equal_pos)};
+        double var_value{std::stod(var_assignment.substr(equal_pos + 1))};
+        context[var_name] = var_value;
+    }
+
+    return true;
+}
+
+bool endsWith(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Without surrounding whitespace, including the \r of CRLF line endings
+std::string trimCell(const std::string &cell) {
+    size_t begin{cell.find_first_not_of(" \t\r")};
+    if (begin == std::string::npos) return "";
+
+    return cell.substr(begin, cell.find_last_not_of(" \t\r") - begin + 1);
+}
+
+// CSV with a header row naming one column per variable
+void readCsvColumns(const std::string &path,
+                    std::map<std::string, std::vector<double>> &columns) {
+    std::ifstream file{path};
+    if (!file) throw std::runtime_error("Cannot open " + path);
+
+    std::string line, cell;
+    std::vector<std::vector<double> *> order;
+
+    std::getline(file, line);
+    std::istringstream header{line};
+
+    while (std::getline(header, cell, ','))
+        order.push_back(&columns[trimCell(cell)]);
+
+    while (std::getline(file, line)) {
+        if (trimCell(line).empty()) continue;
+
+        std::istringstream row{line};
+
+        for (std::vector<double> *column : order) {
+            if (!std::getline(row, cell, ','))
+                throw std::runtime_error("Short row in " + path);
+            column->push_back(std::stod(cell));
+        }
+    }
+}
+
+// Raw array of native-endian doubles
+void readBinaryColumn(const std::string &path, std::vector<double> &column) {
+    std::ifstream file{path, std::ios::binary | std::ios::ate};
+    if (!file) throw std::runtime_error("Cannot open " + path);
+
+    column.resize(static_cast<size_t>(file.tellg()) / sizeof(double));
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(column.data()),
+              column.size() * sizeof(double));
+}
+
+void writeResultColumn(const std::string &path,
+                       const std::vector<double> &result,
+                       const std::vector<std::uint8_t> &errors) {
+    if (endsWith(path, ".bin")) {
+        std::ofstream file{path, std::ios::binary};
+        if (!file) throw std::runtime_error("Cannot open " + path);
+
+        file.write(reinterpret_cast<const char *>(result.data()),
+                   result.size() * sizeof(double));
+        return;
+    }
+
+    std::ofstream file;
+    if (!path.empty()) {
+        file.open(path);
+        if (!file) throw std::runtime_error("Cannot open " + path);
+    }
+
+    std::ostream &out{path.empty() ? std::cout : file};
+
+    for (size_t row = 0; row < result.size(); ++row) {
+        if (errors[row]) out << "error\n";
+        else out << result[row] << "\n";
+    }
+}
+
+int evaluateBatch(int argc, char *argv[]) {
+    std::string expr_str{argv[2]}, out_path;
+    std::map<std::string, std::vector<double>> columns;
+    size_t threads{0};
+
+    for (int i = 3; i < argc; ++i) {
+        std::string arg{argv[i]};
+        size_t equal_pos{arg.find('=')};
+
+        if (arg == "--out" && i + 1 < argc) out_path = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::stoul(argv[++i]);
+        else if (equal_pos != std::string::npos)
+            readBinaryColumn(arg.substr(equal_pos + 1),
+                             columns[arg.substr(0, equal_pos)]);
+        else readCsvColumns(arg, columns);
+    }
+
+    size_t rows{columns.empty() ? 0 : columns.begin()->second.size()};
+    std::map<std::string, const double *> views;
+
+    for (const auto &column : columns) {
+        if (column.second.size() != rows)
+            throw std::runtime_error("Columns differ in length");
+        views[column.first] = column.second.data();
+    }
+
+    std::vector<double> result(rows);
+    std::vector<std::uint8_t> errors(rows);
+    ThreadPool pool{threads};
+
+    size_t failed{Expression<double>::fromString(expr_str).evaluateBatch(
+        views, rows, result.data(), errors.data(), &pool)};
+
+    writeResultColumn(out_path, result, errors);
+
+    if (failed)
+        std::cerr << "Error evaluating expression in " << failed << " of "
+                  << rows << " rows\n";
+
+    return 0;
+}
+
+// Differentiates (or, without --by, just simplifies) one expression per
+// line of a file or stdin, printing one result line per input line. Blank
+// lines are echoed as empty ones, so results stay aligned with the input
+int processStream(int argc, char *argv[]) {
+    std::string path{"-"}, var;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg{argv[i]};
+
+        if (arg == "--by" && i + 1 < argc) var = argv[++i];
+        else path = arg;
+    }
+
+    parser::Parser<double> parser;
+    size_t failed{0};
+
+    auto handle = [&](const char *line, size_t length, size_t lineNumber) {
+        if (std::all_of(line, line + length,
+                        [](char c) { return c == ' ' || c == '\t'; })) {
+            std::cout << "\n";
+            return;
+        }
+
+        // Each line gets its own pool, freed as soon as it is printed
+        ExpressionPool<double>::Scope scope;
+
+        try {
+            Expression<double> expr{parser.parse(line, length)};
+            if (!var.empty()) expr = expr.derivative(var);
+
+            std::cout << expr.simplify().toString() << "\n";
+        } catch (const std::exception &e) {
+            std::cerr << "Error at line " << lineNumber << ": " << e.what()
+                      << "\n";
+            std::cout << "error\n";
+            ++failed;
+        }
+    };
+
+    if (path == "-") {
+        std::string line;
+
+        for (size_t lineNumber = 1; std::getline(std::cin, line); ++lineNumber)
+            handle(line.data(), line.size(), lineNumber);
+    } else {
+        parser::MappedFile file{path};
+        parser::forEachLine(file.data(), file.size(), handle);
+    }
+
+    return failed ? 1 : 0;
+}
+
+// Runs --diff one phase at a time, reporting what each one cost to stderr
+int differentiateWithStats(const std::string &expr_str,
+                           const std::string &var) {
+    // A fresh pool, so node counts only cover this expression
+    ExpressionPool<double>::Scope scope;
+    std::shared_ptr<ExpressionPool<double>> pool{
+        ExpressionPool<double>::current()};
+
+    stats::Profile profile{[&pool]() { return pool->size(); }};
+    std::vector<Token> tokens;
+    parser::Parser<double> parser;
+    Expression<double> expr, derivative, simplified;
+    std::string result;
+
+    try {
+        profile.measure("tokenize", [&]() {
+            parser::tokenize(expr_str.data(), expr_str.size(), tokens);
+        });
+        profile.measure("parse", [&]() { expr = parser.parse(tokens); });
+        profile.measure("derivative",
+                        [&]() { derivative = expr.derivative(var); });
+        profile.measure("simplify",
+                        [&]() { simplified = derivative.simplify(); });
+        profile.measure("toString",
+                        [&]() { result = simplified.toString(); });
+    } catch (const std::exception &e) {
+        std::cerr << "Error differentiating expression: " << e.what() << "\n";
+        profile.print(std::cerr);
+        return 1;
+    }
+
+    std::cout << result << "\n";
+    profile.print(std::cerr);
+
+    return 0;
+}
+
+// Answers line-delimited requests on stdin, or from the clients of a Unix
+// socket, until the input ends
+int serve(int argc, char *argv[]) {
+    std::string socket_path;
+    size_t threads{0}, cache{4096};
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg{argv[i]};
+
+        if (arg == "--socket" && i + 1 < argc) socket_path = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::stoul(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc)
+            cache = std::stoul(argv[++i]);
+        else throw std::runtime_error("Unknown option " + arg);
+    }
+
+    Server server{threads, cache};
+
+    if (socket_path.empty()) server.session(0, 1);
+    else server.listen(socket_path);
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        std::string usageEval{"[--diff 'expression' --by var]"},
+        std::string usageEval{"[--diff 'expression' --by var [--nodes] "
+                              "[--stats]]"},
             usageDiff{"differentiator [--eval 'expression' var1=value1 "
-                      "var2=value2 ...]"};
+                      "var2=value2 ...]"},
+            usageGrad{"[--grad 'expression' var1=value1 var2=value2 ...]"},
+            usageBatch{"[--eval-batch 'expression' (data.csv | "
+                       "var1=var1.bin ...) [--out result] [--threads n]]"},
+            usageStream{"[--stream [file] [--by var]]"},
+            usageServe{"[--serve [--socket path] [--threads n] "
+                       "[--cache entries]]"};
 
-        std::cerr << "Usage: " << usageDiff << " or " << usageEval << '\n';
+        std::cerr << "Usage: " << usageDiff << " or " << usageEval << " or "
+                  << usageGrad << " or " << usageBatch << " or "
+                  << usageStream << " or " << usageServe << '\n';
 
         return 1;
     }
@@ -54,22 +340,63 @@ int main(int argc, char *argv[]) {
         std::string expr_str{argv[2]};
         std::map<std::string, double> context;
 
-        for (int i = 3; i < argc; ++i) {
-            std::string var_assignment{argv[i]};
-            size_t equal_pos{var_assignment.find('=')};
+        if (!readAssignments(argc, argv, 3, context)) return 1;
 
-            if (equal_pos == std::string::npos) {
-                std::cerr << "Error: Invalid variable assignment format\n";
-                return 1;
-            }
+        double result{evaluateExpr(expr_str, context)};
+        std::cout << result << "\n";
+    }
+
+    else if (command == "--grad") {
+        if (argc < 4) {
+            std::cerr << "Error: Missing expression or variable assignments\n";
 
-            std::string var_name{var_assignment.substr(0, equal_pos)};
-            double var_value{std::stod(var_assignment.substr(equal_pos + 1))};
-            context[var_name] = var_value;
+            return 1;
         }
 
-        double result{evaluateExpr(expr_str, context)};
-        std::cout << result << "\n";
+        std::string expr_str{argv[2]};
+        std::map<std::string, double> context;
+
+        if (!readAssignments(argc, argv, 3, context)) return 1;
+
+        Gradient<double> gradient{gradientExpr(expr_str, context)};
+        std::cout << gradient.value << "\n";
+
+        for (const auto &partial : gradient.partials)
+            std::cout << "d/d" << partial.first << " = " << partial.second
+                      << "\n";
+    }
+
+    else if (command == "--eval-batch") {
+        if (argc < 4) {
+            std::cerr << "Error: Missing expression or input columns\n";
+
+            return 1;
+        }
+
+        try {
+            return evaluateBatch(argc, argv);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    else if (command == "--stream") {
+        try {
+            return processStream(argc, argv);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    else if (command == "--serve") {
+        try {
+            return serve(argc, argv);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
     }
 
     else if (command == "--diff") {
@@ -81,9 +408,35 @@ int main(int argc, char *argv[]) {
 
         std::string expr_str{argv[2]};
         std::string var{argv[4]};
+        bool nodes{false};
+
+        for (int i = 5; i < argc; ++i) {
+            std::string flag{argv[i]};
+
+            if (flag == "--stats") return differentiateWithStats(expr_str, var);
+            if (flag == "--nodes") nodes = true;
+        }
 
         auto derivative{differentiateExpr<double>(expr_str, var)};
-        std::cout << derivative.simplify().toString() << "\n";
+        auto simplified{derivative.simplify()};
+        std::cout << simplified.toString() << "\n";
+
+        // Tree size and distinct nodes at each stage, to see what the
+        // simplifier saves
+        if (nodes) {
+            auto report = [](const char *stage, const Expression<double> &e) {
+                std::cerr << stage << ": " << e.nodeCount() << " nodes, "
+                          << e.uniqueNodeCount() << " unique\n";
+            };
+
+            try {
+                report("Input", Expression<double>::fromString(expr_str));
+            } catch (const std::exception &) {
+            }
+
+            report("Derivative", derivative);
+            report("Simplified", simplified);
+        }
     }
 
     else {
@@ -2,178 +2,287 @@
 #define PARSER_TPP
 
 #include "../include/expression.hpp"
-#include <sstream>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
-#include <iostream>
 
-std::vector<Token> parser::tokenize(const std::string &strExpr) {
-  std::vector<Token> tokens;
-  std::istringstream stream(strExpr);
-  char c;
-
-  while (stream >> c) {
-    if (isspace(c)) continue;
-
-    if (isdigit(c) || c == '.') {
-      std::string strValue(1, c);
-      while (stream >> c && (isdigit(c) || c == '.'))
-        strValue += c;
-      stream.putback(c);
-      tokens.push_back(Token(TokenType::Value, strValue));
+void parser::tokenize(const char *source, std::size_t length,
+                      std::vector<Token> &tokens) {
+  auto isDigit = [](char c) {
+    return std::isdigit(static_cast<unsigned char>(c)) || c == '.';
+  };
+
+  auto isLetter = [](char c) {
+    return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+  };
+
+  for (std::size_t i {0}; i < length;) {
+    char c {source[i]};
+    std::size_t start {i++};
+
+    if (std::isspace(static_cast<unsigned char>(c))) continue;
+
+    if (isDigit(c)) {
+      while (i < length && isDigit(source[i])) ++i;
+      tokens.push_back(Token(TokenType::Value, source + start, i - start,
+                             start));
     }
 
-    else if (isalpha(c) || c == '_') {
-      std::string strValue(1, c);
-      while (stream >> c && (isalpha(c) || c == '_'))
-        strValue += c;
-      stream.putback(c);
+    else if (isLetter(c)) {
+      while (i < length && isLetter(source[i])) ++i;
+
+      const char *name {source + start};
+      std::size_t nameLength {i - start};
 
-      if (strValue == "sin" || strValue == "cos" ||
-           strValue == "ln" || strValue == "exp")
+      if ((nameLength == 3 && (std::strncmp(name, "sin", 3) == 0 ||
+                               std::strncmp(name, "cos", 3) == 0 ||
+                               std::strncmp(name, "exp", 3) == 0)) ||
+          (nameLength == 2 && std::strncmp(name, "ln", 2) == 0))
       {
-        tokens.push_back(Token(TokenType::Function, strValue));
+        tokens.push_back(Token(TokenType::Function, name, nameLength, start));
       } else {
-        tokens.push_back(Token(TokenType::Variable, strValue));
+        tokens.push_back(Token(TokenType::Variable, name, nameLength, start));
       }
     }
 
     else if (c == '+' || c == '-' || c == '*' || c == '/' || c == '^') {
-      tokens.push_back(Token(TokenType::Operator, std::string(1, c)));
+      tokens.push_back(Token(TokenType::Operator, source + start, 1, start));
     }
 
     else if (c == '(') {
-      tokens.push_back(Token(TokenType::ParenthesisLeft, std::string(1, c)));
+      tokens.push_back(
+        Token(TokenType::ParenthesisLeft, source + start, 1, start)
+      );
     } else if (c == ')') {
-      tokens.push_back(Token(TokenType::ParenthesisRight, std::string(1, c)));
+      tokens.push_back(
+        Token(TokenType::ParenthesisRight, source + start, 1, start)
+      );
     }
-  }
 
-  return tokens;
+    else {
+      throw std::runtime_error("Unexpected character '" + std::string(1, c) +
+                               "' at position " + std::to_string(start + 1));
+    }
+  }
 }
 
-Token parser::nextToken(std::vector<Token>& tokens) {
-  if (tokens.empty()) throw std::runtime_error("Unexpected end of expression");
+std::vector<Token> parser::tokenize(const std::string &strExpr) {
+  std::vector<Token> tokens;
+  tokenize(strExpr.data(), strExpr.size(), tokens);
 
-  Token token {tokens.front()};
-  tokens.erase(tokens.begin());
-  return token;
+  return tokens;
 }
 
 template <typename T>
-Expression<T> parser::parseExpression(std::vector<Token>& tokens) {
-  Expression<T> leftOperand {parseTerm<T>(tokens)};
-
-  while (!tokens.empty()) {
-    Token operatorToken {tokens.front()};
-
-    if (operatorToken.type == TokenType::Operator &&
-      (operatorToken.strValue == "+" || operatorToken.strValue == "-")) {
-      nextToken(tokens);
-      Expression<T> rightOperand {parseTerm<T>(tokens)};
-
-      if (operatorToken.strValue == "+")
-        leftOperand = leftOperand + rightOperand;
-      else
-        leftOperand = leftOperand - rightOperand;
-    } else break;
-  }
+Expression<T> parser::Parser<T>::parse(const char *source,
+                                       std::size_t length) {
+  m_tokens.clear();
+  tokenize(source, length, m_tokens);
 
-  return leftOperand;
+  return parse(m_tokens);
 }
 
 template <typename T>
-Expression<T> parser::parseTerm(std::vector<Token>& tokens) {
-  Expression<T> leftOperand {parseFactor<T>(tokens)};
+Expression<T> parser::Parser<T>::parse(const std::vector<Token> &tokens) {
+  auto unexpected = [](const Token &token) {
+    return std::runtime_error("Unexpected token " + token.str() +
+                              " at position " +
+                              std::to_string(token.position + 1));
+  };
+
+  m_operands.clear();
+  m_operators.clear();
+
+  bool expectOperand {true};
+
+  for (std::size_t i {0}; i < tokens.size(); ++i) {
+    const Token &token {tokens[i]};
+
+    if (expectOperand) {
+      switch (token.type) {
+        case TokenType::Value: {
+          m_scratch.assign(token.text, token.length);
+
+          char *end;
+          T val (std::strtod(m_scratch.c_str(), &end));
+
+          if (end != m_scratch.c_str() + m_scratch.size())
+            throw std::runtime_error("Invalid number " + m_scratch +
+                                     " at position " +
+                                     std::to_string(token.position + 1));
+
+          m_operands.push_back(Expression<T>(val));
+          expectOperand = false;
+          break;
+        }
+
+        case TokenType::Variable:
+          m_scratch.assign(token.text, token.length);
+          m_operands.push_back(Expression<T>(m_scratch));
+          expectOperand = false;
+          break;
+
+        case TokenType::Function:
+          if (i + 1 == tokens.size() ||
+              tokens[i + 1].type != TokenType::ParenthesisLeft) {
+            throw std::runtime_error(
+              "Expected opening parenthesis after function name at position " +
+              std::to_string(token.position + token.length + 1)
+            );
+          }
+
+          // Node tags of the functions are the first letter of their name
+          m_operators.push_back(Pending {token.text[0], token.position});
+          ++i;
+          break;
+
+        case TokenType::ParenthesisLeft:
+          m_operators.push_back(Pending {'(', token.position});
+          break;
+
+        case TokenType::Operator:
+          if (token.text[0] != '-') throw unexpected(token);
+
+          m_operators.push_back(Pending {'~', token.position});
+          break;
+
+        default: throw unexpected(token);
+      }
+
+      continue;
+    }
 
-  while (!tokens.empty()) {
-    Token operatorToken {tokens.front()};
+    if (token.type == TokenType::Operator) {
+      int tokenPrecedence {precedence(token.text[0])};
 
-    if (operatorToken.type == TokenType::Operator && 
-      (operatorToken.strValue == "*" || operatorToken.strValue == "/")) {
+      // All binary operators are left-associative
+      while (!m_operators.empty() &&
+             precedence(m_operators.back().operation) >= tokenPrecedence)
+        reduce();
 
-      nextToken(tokens);
-      Expression<T> rightOperand {parseFactor<T>(tokens)};
+      m_operators.push_back(Pending {token.text[0], token.position});
+      expectOperand = true;
+    }
+
+    else if (token.type == TokenType::ParenthesisRight) {
+      while (!m_operators.empty() && precedence(m_operators.back().operation))
+        reduce();
+
+      if (m_operators.empty()) throw unexpected(token);
+
+      char opening {m_operators.back().operation};
+      m_operators.pop_back();
+
+      if (opening != '(')
+        m_operands.back() = Expression<T>(m_operands.back(), opening);
+    }
 
-      if (operatorToken.strValue == "*")
-        leftOperand = leftOperand * rightOperand;
-      else leftOperand = leftOperand / rightOperand;
-    } else  break;
+    else throw unexpected(token);
   }
 
-  return leftOperand;
-}
+  if (expectOperand) {
+    // Just past the last token
+    std::size_t end {tokens.empty() ? 0
+                                    : tokens.back().position +
+                                        tokens.back().length};
+    throw std::runtime_error("Unexpected end of expression at position " +
+                             std::to_string(end + 1));
+  }
 
-template <typename T>
-Expression<T> parser::parseFactor(std::vector<Token>& tokens) {
-  Expression<T> leftOperand {parsePrimary<T>(tokens)};
-
-  while (!tokens.empty()) {
-    Token operatorToken {tokens.front()};
-
-    if ((operatorToken.type == TokenType::Operator) && 
-        (operatorToken.strValue == "^")) {
-      nextToken(tokens);
-      Expression<T> rightOperand {parsePrimary<T>(tokens)};
-      leftOperand = leftOperand ^ rightOperand;
-    } else break;
+  while (!m_operators.empty()) {
+    if (!precedence(m_operators.back().operation))
+      throw std::runtime_error(
+        "Expected closing parenthesis for the one at position " +
+        std::to_string(m_operators.back().position + 1)
+      );
+
+    reduce();
   }
 
-  return leftOperand;
+  return m_operands.back();
 }
 
-template <typename T>
-Expression<T> parser::parsePrimary(std::vector<Token>& tokens) {
-  Token token {nextToken(tokens)};
+// Zero for openings, which only a closing parenthesis pops
+template <typename T> int parser::Parser<T>::precedence(char operation) {
+  switch (operation) {
+    case '+': case '-': return 1;
+    case '*': case '/': return 2;
+    case '^': return 3;
+    case '~': return 4;
+    default: return 0;
+  }
+}
+
+template <typename T> void parser::Parser<T>::reduce() {
+  char operation {m_operators.back().operation};
+  m_operators.pop_back();
 
-  if (token.strValue == "-") {
-    Expression<T> expr {parsePrimary<T>(tokens)};
-    return -expr;
+  if (operation == '~') {
+    m_operands.back() = -m_operands.back();
+    return;
   }
 
-  if (token.type == TokenType::Function) {
-    std::string functionName {token.strValue};
+  Expression<T> rightOperand {m_operands.back()};
+  m_operands.pop_back();
 
-    Token openParen {nextToken(tokens)};
-    if (openParen.strValue != "(") {
-      throw std::runtime_error(
-        "Expected opening parenthesis after function name"
-      );
-    }
+  m_operands.back() = Expression<T>(m_operands.back(), operation, rightOperand);
+}
 
-    Expression<T> argument {parseExpression<T>(tokens)};
+parser::MappedFile::MappedFile(const std::string &path)
+    : m_data {nullptr}, m_size {0} {
+  int file {open(path.c_str(), O_RDONLY)};
+  if (file < 0) throw std::runtime_error("Cannot open " + path);
 
-    Token closeParen {nextToken(tokens)};
-    if (closeParen.strValue != ")") {
-      throw std::runtime_error(
-        "Expected closing parenthesis after function arguments"
-      );
+  struct stat info;
+  if (fstat(file, &info) == 0) m_size = static_cast<std::size_t>(info.st_size);
+
+  if (m_size) {
+    void *data {mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0)};
+
+    if (data == MAP_FAILED) {
+      close(file);
+      throw std::runtime_error("Cannot map " + path);
     }
 
-    if (functionName == "sin") return Expression<T>::sin(argument);
-    else if (functionName == "cos") return Expression<T>::cos(argument);
-    else if (functionName == "ln") return Expression<T>::ln(argument);
-    else if (functionName == "exp") return Expression<T>::exp(argument);
-    else throw std::runtime_error("Unknown function: " + functionName);
+    m_data = static_cast<const char *>(data);
   }
 
-  if (token.type == TokenType::Value)
-    return Expression<T>(std::stod(token.strValue));
+  close(file);
+}
+
+parser::MappedFile::~MappedFile() {
+  if (m_data) munmap(const_cast<char *>(m_data), m_size);
+}
 
-  if (token.type == TokenType::Variable)
-    return Expression<T>(token.strValue);
+const char *parser::MappedFile::data() const { return m_data; }
 
-  if (token.strValue == "(") {
-    Expression<T> expr {parseExpression<T>(tokens)};
-    Token closeParen {nextToken(tokens)};
+std::size_t parser::MappedFile::size() const { return m_size; }
 
-    if (closeParen.strValue != ")")
-      throw std::runtime_error("Expected closing parenthesis");
+template <typename F>
+void parser::forEachLine(const char *data, std::size_t length, F handle) {
+  const char *cursor {data}, *end {data + length};
+  std::size_t lineNumber {0};
 
-    return expr;
-  }
+  while (cursor < end) {
+    const char *newline {static_cast<const char *>(
+      std::memchr(cursor, '\n', static_cast<std::size_t>(end - cursor))
+    )};
+    const char *lineEnd {newline ? newline : end};
+    std::size_t lineLength {static_cast<std::size_t>(lineEnd - cursor)};
 
-  throw std::runtime_error("Unexpected token " + token.strValue);
+    ++lineNumber;
+
+    if (lineLength && cursor[lineLength - 1] == '\r') --lineLength;
+    handle(cursor, lineLength, lineNumber);
+
+    cursor = lineEnd + 1;
+  }
 }
 
 #endif // PARSER_TPP
@@ -0,0 +1,201 @@
+#ifndef POOL_TPP
+#define POOL_TPP
+
+#include "../include/pool.hpp"
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+
+template <typename T>
+const typename ExpressionPool<T>::Index ExpressionPool<T>::None;
+template <typename T> const char ExpressionPool<T>::Value;
+template <typename T> const char ExpressionPool<T>::Variable;
+
+template <typename T> ExpressionPool<T>::ExpressionPool() : m_table(64, None) {}
+
+template <typename T>
+typename ExpressionPool<T>::Index ExpressionPool<T>::value(T val) {
+  Node node;
+  node.operation = Value;
+  node.leftExpr = None;
+  node.rightExpr = None;
+  // Every NaN maps to one node, so NaNs compare equal and share it
+  node.val = std::isnan(val) ? std::numeric_limits<T>::quiet_NaN() : val;
+  node.digest = digest(node);
+
+  return intern(node);
+}
+
+template <typename T>
+typename ExpressionPool<T>::Index
+ExpressionPool<T>::variable(const std::string &var) {
+  // insert() would allocate a map node even for a name already interned
+  auto it {m_symbolIds.find(var)};
+
+  if (it == m_symbolIds.end()) {
+    it = m_symbolIds.insert(
+      {var, static_cast<std::uint32_t>(m_symbols.size())}
+    ).first;
+    m_symbols.push_back(var);
+  }
+
+  Node node;
+  node.operation = Variable;
+  node.leftExpr = None;
+  node.rightExpr = None;
+  node.symbol = it->second;
+  node.digest = digest(node);
+
+  return intern(node);
+}
+
+template <typename T>
+typename ExpressionPool<T>::Index
+ExpressionPool<T>::node(Index leftExpr, char operation, Index rightExpr) {
+  Node node;
+  node.operation = operation;
+  node.leftExpr = leftExpr;
+  node.rightExpr = rightExpr;
+  node.symbol = 0;
+  node.digest = digest(node);
+
+  return intern(node);
+}
+
+template <typename T>
+const typename ExpressionPool<T>::Node &
+ExpressionPool<T>::operator[](Index index) const {
+  return m_nodes[index];
+}
+
+template <typename T>
+const std::string &ExpressionPool<T>::symbol(std::uint32_t id) const {
+  return m_symbols[id];
+}
+
+template <typename T>
+std::uint32_t ExpressionPool<T>::findSymbol(const std::string &var) const {
+  auto it {m_symbolIds.find(var)};
+
+  return it != m_symbolIds.end() ? it->second
+                                 : static_cast<std::uint32_t>(m_symbols.size());
+}
+
+template <typename T> std::size_t ExpressionPool<T>::size() const {
+  return m_nodes.size();
+}
+
+template <typename T>
+std::shared_ptr<ExpressionPool<T>> ExpressionPool<T>::current() {
+  std::shared_ptr<ExpressionPool<T>> pool {currentSlot().lock()};
+
+  if (!pool) {
+    pool = std::make_shared<ExpressionPool<T>>();
+    currentSlot() = pool;
+  }
+
+  return pool;
+}
+
+template <typename T>
+std::weak_ptr<ExpressionPool<T>> &ExpressionPool<T>::currentSlot() {
+  static thread_local std::weak_ptr<ExpressionPool<T>> pool;
+
+  return pool;
+}
+
+template <typename T>
+ExpressionPool<T>::Scope::Scope()
+    : m_pool {std::make_shared<ExpressionPool<T>>()},
+      m_previous {currentSlot()} {
+  currentSlot() = m_pool;
+}
+
+template <typename T> ExpressionPool<T>::Scope::~Scope() {
+  currentSlot() = m_previous;
+}
+
+template <typename T>
+typename ExpressionPool<T>::Index ExpressionPool<T>::intern(const Node &node) {
+  std::size_t mask {m_table.size() - 1}, bucket {hash(node) & mask};
+
+  for (; m_table[bucket] != None; bucket = (bucket + 1) & mask)
+    if (equal(m_nodes[m_table[bucket]], node)) return m_table[bucket];
+
+  if (m_nodes.size() >= None)
+    throw std::runtime_error("Expression pool is full");
+
+  Index index {static_cast<Index>(m_nodes.size())};
+  m_nodes.push_back(node);
+  m_table[bucket] = index;
+
+  // Keep the table at most half full
+  if (2 * m_nodes.size() > m_table.size()) rehash(2 * m_table.size());
+
+  return index;
+}
+
+template <typename T>
+std::size_t ExpressionPool<T>::hash(const Node &node) const {
+  std::size_t hash {std::hash<char>()(node.operation)};
+
+  auto combine = [&hash](std::size_t value) {
+    hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  };
+
+  if (node.operation == Value) combine(std::hash<T>()(node.val));
+  else if (node.operation == Variable) combine(node.symbol);
+  else {
+    combine(node.leftExpr);
+    combine(node.rightExpr);
+  }
+
+  return hash;
+}
+
+template <typename T>
+std::uint32_t ExpressionPool<T>::digest(const Node &node) const {
+  std::uint32_t digest {static_cast<unsigned char>(node.operation)};
+
+  auto combine = [&digest](std::size_t value) {
+    digest ^= static_cast<std::uint32_t>(value) + 0x9e3779b9u +
+              (digest << 6) + (digest >> 2);
+  };
+
+  if (node.operation == Value) combine(std::hash<T>()(node.val));
+  else if (node.operation == Variable)
+    combine(std::hash<std::string>()(m_symbols[node.symbol]));
+  else {
+    combine(m_nodes[node.leftExpr].digest);
+    combine(node.rightExpr != None ? m_nodes[node.rightExpr].digest : 0);
+  }
+
+  return digest;
+}
+
+template <typename T>
+bool ExpressionPool<T>::equal(const Node &a, const Node &b) const {
+  if (a.operation != b.operation) return false;
+  if (a.operation == Value)
+    return a.val == b.val || (std::isnan(a.val) && std::isnan(b.val));
+  if (a.operation == Variable) return a.symbol == b.symbol;
+
+  return a.leftExpr == b.leftExpr && a.rightExpr == b.rightExpr;
+}
+
+template <typename T> void ExpressionPool<T>::rehash(std::size_t capacity) {
+  std::vector<Index> table(capacity, None);
+  std::size_t mask {capacity - 1};
+
+  for (Index index {0}; index < m_nodes.size(); ++index) {
+    std::size_t bucket {hash(m_nodes[index]) & mask};
+
+    while (table[bucket] != None) bucket = (bucket + 1) & mask;
+    table[bucket] = index;
+  }
+
+  m_table.swap(table);
+}
+
+#endif // POOL_TPP
@@ -0,0 +1,441 @@
+#ifndef SERVER_TPP
+#define SERVER_TPP
+
+#include "../include/server.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <map>
+#include <poll.h>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+inline Server::Server(std::size_t threads, std::size_t cacheCapacity)
+    : m_window {0}, m_workers {threads}, m_cache {cacheCapacity},
+      m_requests {0}, m_errors {0},
+      m_started {std::chrono::steady_clock::now()} {
+  m_window = std::max<std::size_t>(64, 4 * m_workers.size());
+
+  // A client going away must not take the whole server down
+  std::signal(SIGPIPE, SIG_IGN);
+}
+
+inline void Server::session(int input, int output) {
+  std::deque<std::future<std::string>> pending;
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool finished {false};
+
+  // Responses are written in request order, each as soon as it and all
+  // the ones before it are done
+  std::thread writer([&]() {
+    bool connected {true};
+
+    for (;;) {
+      std::future<std::string> next;
+
+      {
+        std::unique_lock<std::mutex> lock {mutex};
+        changed.wait(lock, [&]() { return !pending.empty() || finished; });
+
+        if (pending.empty()) return;
+
+        next = std::move(pending.front());
+        pending.pop_front();
+      }
+
+      changed.notify_all();
+
+      std::string response {next.get() + "\n"};
+      if (connected) connected = writeAll(output, response);
+    }
+  });
+
+  auto dispatch = [&](const std::string &request) {
+    std::unique_lock<std::mutex> lock {mutex};
+    changed.wait(lock, [&]() { return pending.size() < m_window; });
+
+    pending.push_back(
+      m_workers.submit([this, request]() { return handle(request); })
+    );
+
+    lock.unlock();
+    changed.notify_all();
+  };
+
+  char buffer[4096];
+  std::string line;
+
+  for (;;) {
+    ssize_t count {read(input, buffer, sizeof(buffer))};
+
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) break;
+
+    for (ssize_t i {0}; i < count; ++i) {
+      if (buffer[i] != '\n') {
+        line += buffer[i];
+        continue;
+      }
+
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (!line.empty()) dispatch(line);
+      line.clear();
+    }
+  }
+
+  if (!line.empty()) dispatch(line);
+
+  {
+    std::lock_guard<std::mutex> lock {mutex};
+    finished = true;
+  }
+
+  changed.notify_all();
+  writer.join();
+}
+
+inline void Server::listen(const std::string &path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Socket path is too long: " + path);
+
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  // A socket left behind by an earlier run is replaced, anything else at
+  // the path is not ours to remove
+  struct stat existing;
+
+  if (lstat(path.c_str(), &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode))
+      throw std::runtime_error("Not a socket, refusing to replace " + path);
+
+    unlink(path.c_str());
+  } else if (errno != ENOENT) {
+    throw std::runtime_error("Cannot inspect " + path);
+  }
+
+  int listener {socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (listener < 0) throw std::runtime_error("Cannot create a socket");
+
+  if (bind(listener, reinterpret_cast<const sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      ::listen(listener, SOMAXCONN) < 0) {
+    close(listener);
+    unlink(path.c_str());
+    throw std::runtime_error("Cannot listen on " + path);
+  }
+
+  // SIGINT and SIGTERM write to this pipe, which wakes the accept loop
+  // whichever thread the signal is delivered to. It stays open for the life
+  // of the process: a handler still running on another thread after stop()
+  // must never write to a closed or reused descriptor
+  std::atomic<int> *wakeup {stopPipe()};
+
+  if (wakeup[0].load() < 0) {
+    int ends[2];
+
+    if (pipe(ends) < 0) {
+      close(listener);
+      unlink(path.c_str());
+      throw std::runtime_error("Cannot create a pipe");
+    }
+
+    for (int end : ends) {
+      fcntl(end, F_SETFL, O_NONBLOCK);
+      fcntl(end, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Published before any handler that reads them is installed
+    wakeup[0].store(ends[0]);
+    wakeup[1].store(ends[1]);
+  }
+
+  // Wakeups left over from an earlier listen()
+  char drained[64];
+  while (read(wakeup[0], drained, sizeof(drained)) > 0) {}
+
+  struct sigaction action, interrupt, terminate;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = onStop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, &interrupt);
+  sigaction(SIGTERM, &action, &terminate);
+
+  // Open connections, shut down on stop so that their sessions end before
+  // the server can go away
+  std::mutex mutex;
+  std::condition_variable closed;
+  std::set<int> connections;
+
+  auto stop = [&]() {
+    sigaction(SIGINT, &interrupt, nullptr);
+    sigaction(SIGTERM, &terminate, nullptr);
+    close(listener);
+    unlink(path.c_str());
+
+    // Only reading stops, answers to requests already read are still sent
+    std::unique_lock<std::mutex> lock {mutex};
+    for (int connection : connections) shutdown(connection, SHUT_RD);
+    closed.wait(lock, [&]() { return connections.empty(); });
+  };
+
+  pollfd events[2] {{listener, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+
+  for (;;) {
+    if (poll(events, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+
+      stop();
+      throw std::runtime_error("Cannot wait for connections on " + path);
+    }
+
+    if (events[1].revents) break;
+    if (!events[0].revents) continue;
+
+    int connection {accept(listener, nullptr, nullptr)};
+
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      stop();
+      throw std::runtime_error("Cannot accept connections on " + path);
+    }
+
+    std::lock_guard<std::mutex> lock {mutex};
+    connections.insert(connection);
+
+    std::thread([&, connection]() {
+      session(connection, connection);
+
+      // Closed under the lock, so stop() never shuts down a reused number
+      std::lock_guard<std::mutex> lock {mutex};
+      close(connection);
+      connections.erase(connection);
+      closed.notify_all();
+    }).detach();
+  }
+
+  stop();
+}
+
+inline std::string Server::handle(const std::string &request) {
+  ++m_requests;
+
+  std::size_t position {0};
+  std::string command {nextWord(request, position)};
+  std::string arguments {trim(request.substr(position))};
+
+  try {
+    if (command == "eval") return evaluate(arguments);
+    if (command == "diff") return differentiate(arguments);
+    if (command == "simplify") return simplify(arguments);
+    if (command == "stats") return stats();
+
+    throw std::runtime_error("Unknown request " + command);
+  } catch (const std::exception &e) {
+    ++m_errors;
+
+    // No message may split the response over several lines
+    std::string message {e.what()};
+    std::replace_if(message.begin(), message.end(),
+                    [](char c) { return c == '\r' || c == '\n'; }, ' ');
+
+    return "error: " + trim(message);
+  }
+}
+
+inline std::shared_ptr<Server::Entry>
+Server::lookup(const std::string &expression, const std::string &var) {
+  // Requests are single lines, so a newline cannot be part of either
+  return m_cache.get(expression + '\n' + var);
+}
+
+inline void Server::parse(Entry &entry, const std::string &expression) {
+  if (!entry.parsed) {
+    entry.parsed = true;
+
+    try {
+      ExpressionPool<double>::Scope scope;
+      entry.expr = Expression<double>::fromString(expression);
+    } catch (const std::exception &e) {
+      entry.error = e.what();
+    }
+  }
+
+  if (!entry.error.empty()) throw std::runtime_error(entry.error);
+}
+
+inline std::string Server::evaluate(const std::string &arguments) {
+  std::map<std::string, double> context;
+  std::size_t position {0};
+
+  for (;;) {
+    std::size_t start {position};
+    std::string word {nextWord(arguments, position)};
+    std::size_t equal {word.find('=')};
+
+    if (equal == std::string::npos) {
+      position = start;
+      break;
+    }
+
+    char *end;
+    std::string value {word.substr(equal + 1)};
+    context[word.substr(0, equal)] = std::strtod(value.c_str(), &end);
+
+    if (value.empty() || *end)
+      throw std::runtime_error("Invalid variable assignment " + word);
+  }
+
+  std::string expression {trim(arguments.substr(position))};
+  std::shared_ptr<Entry> entry {lookup(expression, "")};
+  std::shared_ptr<const CompiledExpression<double>> program;
+
+  {
+    std::lock_guard<std::mutex> lock {entry->mutex};
+    parse(*entry, expression);
+
+    if (!entry->program)
+      entry->program = std::make_shared<const CompiledExpression<double>>(
+        entry->expr.compile()
+      );
+
+    program = entry->program;
+  }
+
+  // The tape is never modified once built, so evaluation needs no lock
+  std::vector<double> slots(program->slotCount()),
+    registers(program->registerCount());
+
+  for (std::size_t slot {0}; slot < slots.size(); ++slot) {
+    auto it {context.find(program->variables()[slot])};
+    if (it == context.end()) throw std::runtime_error("Variable not found");
+
+    slots[slot] = it->second;
+  }
+
+  std::ostringstream response;
+  response << program->evaluate(slots.data(), registers.data());
+
+  return response.str();
+}
+
+inline std::string Server::differentiate(const std::string &arguments) {
+  std::size_t position {0};
+  std::string var {nextWord(arguments, position)};
+  std::string expression {trim(arguments.substr(position))};
+
+  if (var.empty() || expression.empty())
+    throw std::runtime_error("Missing expression or differentiation variable");
+
+  std::shared_ptr<Entry> entry {lookup(expression, var)};
+  std::lock_guard<std::mutex> lock {entry->mutex};
+
+  parse(*entry, expression);
+
+  if (entry->derivative.empty())
+    entry->derivative = entry->expr.derivative(var).simplify().toString();
+
+  return entry->derivative;
+}
+
+inline std::string Server::simplify(const std::string &expression) {
+  std::shared_ptr<Entry> entry {lookup(expression, "")};
+  std::lock_guard<std::mutex> lock {entry->mutex};
+
+  parse(*entry, expression);
+
+  if (entry->simplified.empty())
+    entry->simplified = entry->expr.simplify().toString();
+
+  return entry->simplified;
+}
+
+inline std::string Server::stats() const {
+  double seconds {std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - m_started
+  ).count()};
+  std::size_t requests {m_requests.load()};
+
+  std::ostringstream response;
+  response << "requests " << requests << " errors " << m_errors.load()
+           << " hits " << m_cache.hits() << " misses " << m_cache.misses()
+           << " evictions " << m_cache.evictions() << " entries "
+           << m_cache.size() << "/" << m_cache.capacity() << " uptime "
+           << seconds << "s throughput "
+           << (seconds > 0 ? requests / seconds : 0) << "/s";
+
+  return response.str();
+}
+
+inline std::string Server::nextWord(const std::string &text,
+                                    std::size_t &position) {
+  std::size_t begin {text.find_first_not_of(" \t", position)};
+
+  if (begin == std::string::npos) {
+    position = text.size();
+    return "";
+  }
+
+  std::size_t end {text.find_first_of(" \t", begin)};
+  if (end == std::string::npos) end = text.size();
+
+  position = end;
+
+  return text.substr(begin, end - begin);
+}
+
+inline std::string Server::trim(const std::string &text) {
+  std::size_t begin {text.find_first_not_of(" \t")};
+  if (begin == std::string::npos) return "";
+
+  return text.substr(begin, text.find_last_not_of(" \t") - begin + 1);
+}
+
+inline std::atomic<int> *Server::stopPipe() {
+  // Constant-initialized and lock-free, so the signal handler can reach it
+  // safely
+  static std::atomic<int> ends[2] {{-1}, {-1}};
+  return ends;
+}
+
+inline void Server::onStop(int) {
+  int saved {errno};
+  ssize_t ignored {write(stopPipe()[1].load(), "", 1)};
+  (void)ignored;
+  errno = saved;
+}
+
+inline bool Server::writeAll(int output, const std::string &data) {
+  std::size_t written {0};
+
+  while (written < data.size()) {
+    ssize_t count {write(output, data.data() + written,
+                         data.size() - written)};
+
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+
+    written += static_cast<std::size_t>(count);
+  }
+
+  return true;
+}
+
+#endif // SERVER_TPP
@@ -0,0 +1,564 @@
+#ifndef STATIC_EXPRESSION_TPP
+#define STATIC_EXPRESSION_TPP
+
+#include "../include/expression.hpp"
+#include "../include/static_expression.hpp"
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+namespace static_expr {
+template <typename E> struct IntegerTraits {
+  static constexpr bool integer {false};
+  static constexpr long value {0};
+};
+
+template <long N> struct IntegerTraits<Integer<N>> {
+  static constexpr bool integer {true};
+  static constexpr long value {N};
+};
+
+template <typename E> struct UnaryTraits {
+  static constexpr char operation {0};
+};
+
+template <char Op, typename U> struct UnaryTraits<Unary<Op, U>> {
+  static constexpr char operation {Op};
+};
+
+template <typename E> constexpr bool isInteger() {
+  return IntegerTraits<E>::integer;
+}
+
+template <typename E> constexpr bool isInteger(long n) {
+  return IntegerTraits<E>::integer && IntegerTraits<E>::value == n;
+}
+
+template <typename E> constexpr long integerValue() {
+  return IntegerTraits<E>::value;
+}
+
+constexpr long power(long base, long exponent) {
+  return exponent == 0 ? 1 : base * power(base, exponent - 1);
+}
+
+constexpr long fold(char op, long left, long right) {
+  return op == '+'   ? left + right
+         : op == '-' ? left - right
+         : op == '*' ? left * right
+         : op == '/' ? left / right
+                     : power(left, right);
+}
+
+// Same identities as Expression<T>::build(), plus exact integer arithmetic
+template <char Op, typename L, typename R> constexpr Rule binaryRule() {
+  return Op == '+' ? (isInteger<L>() && isInteger<R>() ? Rule::Fold
+                      : isInteger<L>(0)                ? Rule::Right
+                      : isInteger<R>(0)                ? Rule::Left
+                                                       : Rule::Keep)
+         : Op == '-' ? (isInteger<L>() && isInteger<R>() ? Rule::Fold
+                        : isInteger<R>(0)                ? Rule::Left
+                        : isInteger<L>(0)                ? Rule::Negate
+                                                         : Rule::Keep)
+         : Op == '*' ? (isInteger<L>() && isInteger<R>() ? Rule::Fold
+                        : isInteger<L>(0) || isInteger<R>(0) ? Rule::Zero
+                        : isInteger<L>(1)                    ? Rule::Right
+                        : isInteger<R>(1)                    ? Rule::Left
+                                                             : Rule::Keep)
+         : Op == '/' ? (isInteger<R>(0)   ? Rule::Keep
+                        : isInteger<L>(0) ? Rule::Zero
+                        : isInteger<R>(1) ? Rule::Left
+                        : isInteger<L>() && isInteger<R>() &&
+                              integerValue<L>() % integerValue<R>() == 0
+                          ? Rule::Fold
+                          : Rule::Keep)
+         : Op == '^' ? (isInteger<R>(0) || isInteger<L>(1) ? Rule::One
+                        : isInteger<R>(1)                  ? Rule::Left
+                        : isInteger<L>() && isInteger<R>() &&
+                              integerValue<R>() > 0
+                          ? Rule::Fold
+                          : Rule::Keep)
+                     : Rule::Keep;
+}
+
+template <char Op, typename U> constexpr Rule unaryRule() {
+  return Op == '-' ? (isInteger<U>()                           ? Rule::Fold
+                      : UnaryTraits<U>::operation == '-'       ? Rule::Inner
+                                                               : Rule::Keep)
+         : Op == 's' ? (isInteger<U>(0) ? Rule::Zero : Rule::Keep)
+         : Op == 'c' ? (isInteger<U>(0) ? Rule::One : Rule::Keep)
+         : Op == 'e' ? (isInteger<U>(0) ? Rule::One : Rule::Keep)
+         : Op == 'l' ? (isInteger<U>(1)                       ? Rule::Zero
+                        : UnaryTraits<U>::operation == 'e'   ? Rule::Inner
+                                                             : Rule::Keep)
+                     : Rule::Keep;
+}
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::Keep> {
+  using type = Binary<Op, L, R>;
+
+  static type make(const L &left, const R &right) {
+    return type {left, right};
+  }
+};
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::Fold> {
+  using type = Integer<fold(Op, L::value, R::value)>;
+
+  static type make(const L &, const R &) { return type {}; }
+};
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::Left> {
+  using type = L;
+
+  static type make(const L &left, const R &) { return left; }
+};
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::Right> {
+  using type = R;
+
+  static type make(const L &, const R &right) { return right; }
+};
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::Zero> {
+  using type = Integer<0>;
+
+  static type make(const L &, const R &) { return type {}; }
+};
+
+template <char Op, typename L, typename R> struct Make<Op, L, R, Rule::One> {
+  using type = Integer<1>;
+
+  static type make(const L &, const R &) { return type {}; }
+};
+
+template <char Op, typename L, typename R>
+struct Make<Op, L, R, Rule::Negate> {
+  using type = typename MakeUnary<'-', R>::type;
+
+  static type make(const L &, const R &right) {
+    return MakeUnary<'-', R>::make(right);
+  }
+};
+
+template <char Op, typename U> struct MakeUnary<Op, U, Rule::Keep> {
+  using type = Unary<Op, U>;
+
+  static type make(const U &operand) { return type {operand}; }
+};
+
+template <char Op, typename U> struct MakeUnary<Op, U, Rule::Fold> {
+  using type = Integer<-U::value>;
+
+  static type make(const U &) { return type {}; }
+};
+
+template <char Op, typename U> struct MakeUnary<Op, U, Rule::Zero> {
+  using type = Integer<0>;
+
+  static type make(const U &) { return type {}; }
+};
+
+template <char Op, typename U> struct MakeUnary<Op, U, Rule::One> {
+  using type = Integer<1>;
+
+  static type make(const U &) { return type {}; }
+};
+
+template <char Op, char Inner, typename V>
+struct MakeUnary<Op, Unary<Inner, V>, Rule::Inner> {
+  using type = V;
+
+  static type make(const Unary<Inner, V> &operand) { return operand.operand; }
+};
+
+template <char Op> struct Operation;
+
+template <> struct Operation<'+'> {
+  template <typename T> static T apply(T left, T right) { return left + right; }
+};
+
+template <> struct Operation<'-'> {
+  template <typename T> static T apply(T left, T right) { return left - right; }
+  template <typename T> static T apply(T operand) { return -operand; }
+};
+
+template <> struct Operation<'*'> {
+  template <typename T> static T apply(T left, T right) { return left * right; }
+};
+
+template <> struct Operation<'/'> {
+  template <typename T> static T apply(T left, T right) { return left / right; }
+};
+
+template <> struct Operation<'^'> {
+  template <typename T> static T apply(T left, T right) {
+    return std::pow(left, right);
+  }
+};
+
+template <> struct Operation<'s'> {
+  template <typename T> static T apply(T operand) { return std::sin(operand); }
+};
+
+template <> struct Operation<'c'> {
+  template <typename T> static T apply(T operand) { return std::cos(operand); }
+};
+
+template <> struct Operation<'l'> {
+  template <typename T> static T apply(T operand) { return std::log(operand); }
+};
+
+template <> struct Operation<'e'> {
+  template <typename T> static T apply(T operand) { return std::exp(operand); }
+};
+
+// Derivative rules, in the same form as Expression<T>::derivative() but
+// built with build() so the result type is simplified as it is formed
+template <long N, typename Var> struct Derivative<Integer<N>, Var> {
+  using type = Integer<0>;
+
+  static type make(const Integer<N> &) { return type {}; }
+};
+
+template <typename A, typename Var> struct Derivative<Value<A>, Var> {
+  using type = Integer<0>;
+
+  static type make(const Value<A> &) { return type {}; }
+};
+
+template <std::size_t Slot, std::size_t Other>
+struct Derivative<Variable<Slot>, Variable<Other>> {
+  using type = Integer<Slot == Other ? 1 : 0>;
+
+  static type make(const Variable<Slot> &) { return type {}; }
+};
+
+template <typename L, typename R, typename Var>
+struct Derivative<Binary<'+', L, R>, Var> {
+  using DL = Derivative<L, Var>;
+  using DR = Derivative<R, Var>;
+
+  static auto make(const Binary<'+', L, R> &expr)
+    -> decltype(build<'+'>(DL::make(expr.left), DR::make(expr.right))) {
+    return build<'+'>(DL::make(expr.left), DR::make(expr.right));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'+', L, R> &>()));
+};
+
+template <typename L, typename R, typename Var>
+struct Derivative<Binary<'-', L, R>, Var> {
+  using DL = Derivative<L, Var>;
+  using DR = Derivative<R, Var>;
+
+  static auto make(const Binary<'-', L, R> &expr)
+    -> decltype(build<'-'>(DL::make(expr.left), DR::make(expr.right))) {
+    return build<'-'>(DL::make(expr.left), DR::make(expr.right));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'-', L, R> &>()));
+};
+
+template <typename L, typename R, typename Var>
+struct Derivative<Binary<'*', L, R>, Var> {
+  using DL = Derivative<L, Var>;
+  using DR = Derivative<R, Var>;
+
+  static auto make(const Binary<'*', L, R> &expr)
+    -> decltype(build<'+'>(build<'*'>(DL::make(expr.left), expr.right),
+                           build<'*'>(expr.left, DR::make(expr.right)))) {
+    return build<'+'>(build<'*'>(DL::make(expr.left), expr.right),
+                      build<'*'>(expr.left, DR::make(expr.right)));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'*', L, R> &>()));
+};
+
+template <typename L, typename R, typename Var>
+struct Derivative<Binary<'/', L, R>, Var> {
+  using DL = Derivative<L, Var>;
+  using DR = Derivative<R, Var>;
+
+  static auto make(const Binary<'/', L, R> &expr)
+    -> decltype(build<'/'>(
+      build<'-'>(build<'*'>(DL::make(expr.left), expr.right),
+                 build<'*'>(expr.left, DR::make(expr.right))),
+      build<'^'>(expr.right, Integer<2> {}))) {
+    return build<'/'>(
+      build<'-'>(build<'*'>(DL::make(expr.left), expr.right),
+                 build<'*'>(expr.left, DR::make(expr.right))),
+      build<'^'>(expr.right, Integer<2> {}));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'/', L, R> &>()));
+};
+
+// u ^ c with c constant in Var: c * u ^ (c - 1) * u'
+template <typename L, typename R, typename Var, bool ConstantExponent>
+struct PowerDerivative {
+  using DL = Derivative<L, Var>;
+
+  static auto make(const Binary<'^', L, R> &expr)
+    -> decltype(build<'*'>(
+      build<'*'>(expr.right,
+                 build<'^'>(expr.left, build<'-'>(expr.right, Integer<1> {}))),
+      DL::make(expr.left))) {
+    return build<'*'>(
+      build<'*'>(expr.right,
+                 build<'^'>(expr.left, build<'-'>(expr.right, Integer<1> {}))),
+      DL::make(expr.left));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'^', L, R> &>()));
+};
+
+// u ^ v in general: u ^ v * (v' * ln(u) + v * u' / u)
+template <typename L, typename R, typename Var>
+struct PowerDerivative<L, R, Var, false> {
+  using DL = Derivative<L, Var>;
+  using DR = Derivative<R, Var>;
+
+  static auto make(const Binary<'^', L, R> &expr)
+    -> decltype(build<'*'>(
+      expr, build<'+'>(build<'*'>(DR::make(expr.right), build<'l'>(expr.left)),
+                       build<'/'>(build<'*'>(expr.right, DL::make(expr.left)),
+                                  expr.left)))) {
+    return build<'*'>(
+      expr, build<'+'>(build<'*'>(DR::make(expr.right), build<'l'>(expr.left)),
+                       build<'/'>(build<'*'>(expr.right, DL::make(expr.left)),
+                                  expr.left)));
+  }
+
+  using type = decltype(make(std::declval<const Binary<'^', L, R> &>()));
+};
+
+template <typename L, typename R, typename Var>
+struct Derivative<Binary<'^', L, R>, Var>
+    : PowerDerivative<L, R, Var,
+                      std::is_same<typename Derivative<R, Var>::type,
+                                   Integer<0>>::value> {};
+
+template <typename U, typename Var> struct Derivative<Unary<'-', U>, Var> {
+  using DU = Derivative<U, Var>;
+
+  static auto make(const Unary<'-', U> &expr)
+    -> decltype(build<'-'>(DU::make(expr.operand))) {
+    return build<'-'>(DU::make(expr.operand));
+  }
+
+  using type = decltype(make(std::declval<const Unary<'-', U> &>()));
+};
+
+template <typename U, typename Var> struct Derivative<Unary<'s', U>, Var> {
+  using DU = Derivative<U, Var>;
+
+  static auto make(const Unary<'s', U> &expr)
+    -> decltype(build<'*'>(build<'c'>(expr.operand), DU::make(expr.operand))) {
+    return build<'*'>(build<'c'>(expr.operand), DU::make(expr.operand));
+  }
+
+  using type = decltype(make(std::declval<const Unary<'s', U> &>()));
+};
+
+template <typename U, typename Var> struct Derivative<Unary<'c', U>, Var> {
+  using DU = Derivative<U, Var>;
+
+  static auto make(const Unary<'c', U> &expr)
+    -> decltype(build<'*'>(build<'-'>(build<'s'>(expr.operand)),
+                           DU::make(expr.operand))) {
+    return build<'*'>(build<'-'>(build<'s'>(expr.operand)),
+                      DU::make(expr.operand));
+  }
+
+  using type = decltype(make(std::declval<const Unary<'c', U> &>()));
+};
+
+template <typename U, typename Var> struct Derivative<Unary<'l', U>, Var> {
+  using DU = Derivative<U, Var>;
+
+  static auto make(const Unary<'l', U> &expr)
+    -> decltype(build<'/'>(DU::make(expr.operand), expr.operand)) {
+    return build<'/'>(DU::make(expr.operand), expr.operand);
+  }
+
+  using type = decltype(make(std::declval<const Unary<'l', U> &>()));
+};
+
+template <typename U, typename Var> struct Derivative<Unary<'e', U>, Var> {
+  using DU = Derivative<U, Var>;
+
+  static auto make(const Unary<'e', U> &expr)
+    -> decltype(build<'*'>(expr, DU::make(expr.operand))) {
+    return build<'*'>(expr, DU::make(expr.operand));
+  }
+
+  using type = decltype(make(std::declval<const Unary<'e', U> &>()));
+};
+} // namespace static_expr
+
+template <long N>
+template <typename T>
+T static_expr::Integer<N>::evaluate(const T *) const {
+  return T(N);
+}
+
+template <long N>
+template <typename T>
+Expression<T> static_expr::Integer<N>::toExpression(
+  const std::vector<std::string> &) const {
+  return Expression<T>(T(N));
+}
+
+template <typename A>
+template <typename T>
+T static_expr::Value<A>::evaluate(const T *) const {
+  return T(val);
+}
+
+template <typename A>
+template <typename T>
+Expression<T> static_expr::Value<A>::toExpression(
+  const std::vector<std::string> &) const {
+  return Expression<T>(T(val));
+}
+
+template <std::size_t Slot>
+template <typename T>
+T static_expr::Variable<Slot>::evaluate(const T *slots) const {
+  return slots[Slot];
+}
+
+template <std::size_t Slot>
+template <typename T>
+Expression<T> static_expr::Variable<Slot>::toExpression(
+  const std::vector<std::string> &variables) const {
+  if (Slot >= variables.size())
+    throw std::runtime_error("No variable name for slot " +
+                             std::to_string(Slot));
+
+  return Expression<T>(variables[Slot]);
+}
+
+template <char Op, typename L, typename R>
+template <typename T>
+T static_expr::Binary<Op, L, R>::evaluate(const T *slots) const {
+  return Operation<Op>::apply(left.evaluate(slots), right.evaluate(slots));
+}
+
+template <char Op, typename L, typename R>
+template <typename T>
+Expression<T> static_expr::Binary<Op, L, R>::toExpression(
+  const std::vector<std::string> &variables) const {
+  return Expression<T>(left.template toExpression<T>(variables), Op,
+                       right.template toExpression<T>(variables));
+}
+
+template <char Op, typename U>
+template <typename T>
+T static_expr::Unary<Op, U>::evaluate(const T *slots) const {
+  return Operation<Op>::apply(operand.evaluate(slots));
+}
+
+template <char Op, typename U>
+template <typename T>
+Expression<T> static_expr::Unary<Op, U>::toExpression(
+  const std::vector<std::string> &variables) const {
+  Expression<T> runtimeOperand {operand.template toExpression<T>(variables)};
+
+  // Expression<T> spells unary minus as a product with -1
+  return Op == '-' ? -runtimeOperand : Expression<T>(runtimeOperand, Op);
+}
+
+template <char Op, typename L, typename R>
+typename static_expr::Make<Op, L, R>::type
+static_expr::build(const L &left, const R &right) {
+  return Make<Op, L, R>::make(left, right);
+}
+
+template <char Op, typename U>
+typename static_expr::MakeUnary<Op, U>::type
+static_expr::build(const U &operand) {
+  return MakeUnary<Op, U>::make(operand);
+}
+
+template <typename L, typename R, typename>
+static_expr::BinaryResult<'+', L, R>
+static_expr::operator+(const L &left, const R &right) {
+  return build<'+'>(Operand<L>::make(left), Operand<R>::make(right));
+}
+
+template <typename L, typename R, typename>
+static_expr::BinaryResult<'-', L, R>
+static_expr::operator-(const L &left, const R &right) {
+  return build<'-'>(Operand<L>::make(left), Operand<R>::make(right));
+}
+
+template <typename L, typename R, typename>
+static_expr::BinaryResult<'*', L, R>
+static_expr::operator*(const L &left, const R &right) {
+  return build<'*'>(Operand<L>::make(left), Operand<R>::make(right));
+}
+
+template <typename L, typename R, typename>
+static_expr::BinaryResult<'/', L, R>
+static_expr::operator/(const L &left, const R &right) {
+  return build<'/'>(Operand<L>::make(left), Operand<R>::make(right));
+}
+
+template <typename L, typename R, typename>
+static_expr::BinaryResult<'^', L, R>
+static_expr::operator^(const L &left, const R &right) {
+  return build<'^'>(Operand<L>::make(left), Operand<R>::make(right));
+}
+
+template <typename U, typename>
+typename static_expr::MakeUnary<'-', U>::type
+static_expr::operator-(const U &operand) {
+  return build<'-'>(operand);
+}
+
+template <typename U>
+typename static_expr::MakeUnary<'s', U>::type
+static_expr::sin(const U &operand) {
+  return build<'s'>(operand);
+}
+
+template <typename U>
+typename static_expr::MakeUnary<'c', U>::type
+static_expr::cos(const U &operand) {
+  return build<'c'>(operand);
+}
+
+template <typename U>
+typename static_expr::MakeUnary<'l', U>::type
+static_expr::ln(const U &operand) {
+  return build<'l'>(operand);
+}
+
+template <typename U>
+typename static_expr::MakeUnary<'e', U>::type
+static_expr::exp(const U &operand) {
+  return build<'e'>(operand);
+}
+
+template <typename Var, typename E>
+typename static_expr::Derivative<E, typename std::remove_cv<Var>::type>::type
+static_expr::derivative(const E &expr) {
+  return Derivative<E, typename std::remove_cv<Var>::type>::make(expr);
+}
+
+template <typename Var, typename E>
+typename static_expr::Derivative<E, Var>::type
+static_expr::derivative(const E &expr, const Var &) {
+  return Derivative<E, Var>::make(expr);
+}
+
+template <typename T, typename E>
+Expression<T>
+static_expr::toExpression(const E &expr,
+                          const std::vector<std::string> &variables) {
+  return expr.template toExpression<T>(variables);
+}
+
+#endif // STATIC_EXPRESSION_TPP
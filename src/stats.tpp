@@ -0,0 +1,80 @@
+#ifndef STATS_TPP
+#define STATS_TPP
+
+#include "../include/stats.hpp"
+#include <algorithm>
+#include <iomanip>
+
+namespace stats {
+namespace detail {
+// Defined in allocations.cpp. Weak, so it is null where that is not linked in
+__attribute__((weak)) Allocations countedAllocations();
+} // namespace detail
+} // namespace stats
+
+inline stats::Allocations stats::allocations() {
+  if (!detail::countedAllocations) return Allocations {0, 0, false};
+
+  return detail::countedAllocations();
+}
+
+inline stats::Profile::Profile(std::function<std::size_t()> nodes)
+    : m_nodes {nodes} {}
+
+template <typename F>
+void stats::Profile::measure(const std::string &name, F task) {
+  Allocations before {allocations()};
+  Clock::time_point start {Clock::now()};
+
+  task();
+
+  Clock::time_point end {Clock::now()};
+  Allocations after {allocations()};
+
+  m_phases.push_back(Phase {
+    name, std::chrono::duration<double>(end - start).count(),
+    after.count - before.count, after.bytes - before.bytes,
+    m_nodes ? m_nodes() : 0
+  });
+}
+
+inline const std::vector<stats::Phase> &stats::Profile::phases() const {
+  return m_phases;
+}
+
+inline void stats::Profile::print(std::ostream &out) const {
+  Phase total {"total", 0, 0, 0, 0};
+
+  std::ios::fmtflags flags {out.flags()};
+  out << std::left << std::setw(12) << "phase" << std::right << std::setw(12)
+      << "time (us)" << std::setw(10) << "nodes" << std::setw(10) << "allocs"
+      << std::setw(12) << "bytes" << "\n";
+
+  bool counted {allocations().counted};
+
+  auto row = [&out, counted](const Phase &phase) {
+    out << std::left << std::setw(12) << phase.name << std::right
+        << std::setw(12) << std::fixed << std::setprecision(1)
+        << phase.seconds * 1e6 << std::setw(10) << phase.nodes;
+
+    if (counted)
+      out << std::setw(10) << phase.allocations << std::setw(12)
+          << phase.bytes << "\n";
+    else
+      out << std::setw(10) << "-" << std::setw(12) << "-" << "\n";
+  };
+
+  for (const Phase &phase : m_phases) {
+    row(phase);
+
+    total.seconds += phase.seconds;
+    total.allocations += phase.allocations;
+    total.bytes += phase.bytes;
+    total.nodes = std::max(total.nodes, phase.nodes);
+  }
+
+  row(total);
+  out.flags(flags);
+}
+
+#endif // STATS_TPP
@@ -2,7 +2,19 @@
 #define TESTS_TPP
 
 #include "../include/expression.hpp"
+#include "../include/lru_cache.hpp"
+#include "../include/server.hpp"
+#include "../include/static_expression.hpp"
 #include "../include/tests.hpp"
+#include "../include/thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <type_traits>
 
 template <typename T>
 void tests::printResult(bool condition, const std::string &testName) {
@@ -65,6 +77,83 @@ void tests::mathFunctions() {
   printResult<T>(expr4.toString() == "exp(x)", "exp(x)");
 }
 
+template <typename T>
+void tests::parsing() {
+  Expression<T> x {"x"}, y {"y"}, z {"z"};
+
+  Expression<T> two {2};
+
+  printResult<T>(Expression<T>::fromString("x - y - z") == ((x - y) - z) &&
+                 Expression<T>::fromString("x / y * z") == ((x / y) * z) &&
+                 Expression<T>::fromString("x ^ y ^ z") == ((x ^ y) ^ z),
+                 "Parsing left-associative operators");
+
+  printResult<T>(Expression<T>::fromString("-x ^ 2") == ((-x) ^ two) &&
+                 Expression<T>::fromString("2 ^ -x") == (two ^ (-x)) &&
+                 Expression<T>::fromString("x + y * sin(z)") ==
+                   (x + y * Expression<T>::sin(z)),
+                 "Parsing precedence and unary minus");
+
+  std::string deep(100000, '(');
+  deep += "x" + std::string(100000, ')');
+  printResult<T>(Expression<T>::fromString(deep) == x,
+                 "Parsing deeply nested expression");
+
+  std::string message;
+  try { Expression<T>::fromString("x + * y"); }
+  catch (const std::runtime_error &e) { message = e.what(); }
+  printResult<T>(message == "Unexpected token * at position 5",
+                 "Parse error reports position");
+
+  message.clear();
+  try { Expression<T>::fromString("sin(x *"); }
+  catch (const std::runtime_error &e) { message = e.what(); }
+  printResult<T>(message == "Unexpected end of expression at position 8",
+                 "Truncated expression reports position");
+}
+
+// Machine-generated input can be far deeper than the call stack allows, so
+// none of the walks over an expression may recurse per level
+template <typename T>
+void tests::deepExpressions() {
+  std::string chain;
+  for (int level {0}; level < 10000; ++level) chain += "sin(";
+  chain += "x" + std::string(10000, ')');
+
+  Expression<T> nested {Expression<T>::fromString(chain)};
+  Expression<T> slope {nested.derivative("x")};
+
+  // Every cos(sin(...sin(0))) factor is 1
+  printResult<T>(nested.toString() == chain && nested.simplify() == nested &&
+                 nested.evaluate({{"x", 0}}) == 0 &&
+                 nested.compile().evaluate(std::vector<T> {0}) == 0 &&
+                 slope.evaluate({{"x", 0}}) == 1 &&
+                 slope.compile().evaluate(std::vector<T> {0}) == 1,
+                 "Deep sin chain through derivative, toString and compile");
+
+  // Simplifying the derivative flattens a product of one cos per level, so
+  // a shallower chain keeps this check cheap
+  std::string shallow;
+  for (int level {0}; level < 300; ++level) shallow += "sin(";
+  shallow += "x" + std::string(300, ')');
+
+  printResult<T>(Expression<T>::fromString(shallow).derivative("x")
+                   .simplify().evaluate({{"x", 0}}) == 1,
+                 "Simplified derivative of a sin chain");
+
+  std::string terms {"x"};
+  for (int term {1}; term < 100000; ++term) terms += " + x";
+
+  Expression<T> sum {Expression<T>::fromString(terms)};
+
+  printResult<T>(sum.toString() == terms &&
+                 sum.derivative("x") == Expression<T>(100000) &&
+                 sum.simplify().toString() == "(100000)*(x)" &&
+                 sum.compile().evaluate(std::vector<T> {2}) == 200000 &&
+                 sum.evaluate({{"x", 2}}) == 200000,
+                 "Long sum through derivative, toString and compile");
+}
+
 template <typename T>
 void tests::substitution() {
   Expression<T> expr1 {Expression<T>("x") + Expression<T>(2)};
@@ -79,6 +168,132 @@ void tests::evaluation() {
   printResult<T>(result == 5, "Evaluation with x=3");
 }
 
+template <typename T>
+void tests::compilation() {
+  Expression<T> expr1 {Expression<T>::fromString("x * sin(y) + x ^ 2 / y")};
+  CompiledExpression<T> program {expr1.compile()};
+  std::map<std::string, T> context {{"x", 3}, {"y", 2}};
+  printResult<T>(program.evaluate(context) == expr1.evaluate(context),
+                 "Compiled evaluation matches tree evaluation");
+
+  program = expr1.compile({"y", "x"});
+  printResult<T>(
+    program.evaluate(std::vector<T> {2, 3}) == expr1.evaluate(context),
+    "Compiled evaluation with slot order"
+  );
+
+  bool threw {false};
+  try {
+    Expression<T>::fromString("x / y").compile().evaluate(
+      {{"x", 1}, {"y", 0}}
+    );
+  } catch (const std::runtime_error &) { threw = true; }
+  printResult<T>(threw, "Compiled division by zero throws");
+
+  threw = false;
+  try {
+    Expression<T>::fromString("ln(x)").compile().evaluate({{"x", 0}});
+  } catch (const std::runtime_error &) { threw = true; }
+  printResult<T>(threw, "Compiled ln() domain error throws");
+}
+
+template <typename T>
+void tests::batchEvaluation() {
+  Expression<T> expr1 {Expression<T>::fromString("ln(x) / y + x * y")};
+  std::vector<T> x, y;
+
+  for (int row {0}; row < 1000; ++row) {
+    x.push_back(T(row % 7) - 1);
+    y.push_back(T(row % 5));
+  }
+
+  std::vector<T> result(x.size());
+  std::vector<std::uint8_t> errors(x.size());
+  ThreadPool pool {3};
+
+  std::size_t failed {expr1.evaluateBatch(
+    {{"x", x.data()}, {"y", y.data()}}, x.size(), result.data(),
+    errors.data(), &pool
+  )};
+
+  // The sin, cos, ln and exp kernels may differ from std:: in the last bits
+  auto close = [](T value, T expected) {
+    return (std::isnan(value) && std::isnan(expected)) || value == expected ||
+           std::abs(value - expected) <= T(1e-12) * std::abs(expected);
+  };
+
+  bool matches {true};
+  std::size_t expectedFailures {0};
+
+  for (std::size_t row {0}; row < x.size(); ++row) {
+    try {
+      T expected {expr1.evaluate({{"x", x[row]}, {"y", y[row]}})};
+      matches &= !errors[row] && close(result[row], expected);
+    } catch (const std::runtime_error &) {
+      matches &= errors[row] == 1;
+      ++expectedFailures;
+    }
+  }
+
+  printResult<T>(matches, "Batch evaluation matches row-wise evaluation");
+  printResult<T>(failed == expectedFailures, "Batch evaluation error count");
+
+  // Negative bases with integer and fractional exponents, and arguments
+  // outside the kernels' ranges
+  Expression<T> expr2 {
+    Expression<T>::fromString("sin(x * y) - cos(x) * exp(y) + x ^ y")
+  };
+  const T special[] {T(0), T(-0.5), T(3), T(-2), T(1e7), T(800), T(-800),
+                     std::numeric_limits<T>::infinity()};
+
+  x.clear();
+  y.clear();
+
+  for (int row {0}; row < 1000; ++row) {
+    x.push_back(T(row % 13) * T(0.75) - T(4));
+    y.push_back(row % 3 ? T(row % 11) - T(5) : T(row % 7) * T(0.3));
+  }
+
+  for (T a : special)
+    for (T b : special) {
+      x.push_back(a);
+      y.push_back(b);
+    }
+
+  result.resize(x.size());
+  errors.resize(x.size());
+  expr2.evaluateBatch({{"x", x.data()}, {"y", y.data()}}, x.size(),
+                      result.data(), errors.data(), &pool);
+
+  matches = true;
+
+  for (std::size_t row {0}; row < x.size(); ++row)
+    matches &= close(result[row],
+                     expr2.evaluate({{"x", x[row]}, {"y", y[row]}}));
+
+  printResult<T>(matches, "Batch kernels match row-wise evaluation");
+
+  // ^ has no kernel, so integer powers stay exact
+  Expression<T> expr3 {Expression<T>::fromString("x ^ y + x / y")};
+  expr3.evaluateBatch({{"x", x.data()}, {"y", y.data()}}, x.size(),
+                      result.data(), errors.data(), &pool);
+
+  matches = true;
+
+  for (std::size_t row {0}; row < x.size(); ++row) {
+    try {
+      T expected {expr3.evaluate({{"x", x[row]}, {"y", y[row]}})};
+      matches &= !errors[row] &&
+                 (result[row] == expected ||
+                  (std::isnan(result[row]) && std::isnan(expected)));
+    } catch (const std::runtime_error &) {
+      matches &= errors[row] == 1;
+    }
+  }
+
+  printResult<T>(matches, "Batch powers match row-wise evaluation exactly");
+}
+
 template <typename T>
 void tests::derivative() {
   Expression<T> expr1 {Expression<T>(3) * Expression<T>("x") + 
@@ -87,6 +302,364 @@ void tests::derivative() {
   printResult<T>(result.toString() == "3", "Derivative of 3x + 2");
 }
 
+template <typename T>
+void tests::simplification() {
+  auto simplified = [](const char *exprString) {
+    return Expression<T>::fromString(exprString).simplify();
+  };
+
+  printResult<T>(simplified("x * 3 + x * 2") == simplified("5 * x") &&
+                 simplified("x + y - x").toString() == "y",
+                 "Simplify collects like terms");
+
+  printResult<T>(simplified("x * x ^ 2 / y * y") == simplified("x ^ 3") &&
+                 simplified("(x ^ 2) ^ 3") == simplified("x ^ 6"),
+                 "Simplify merges powers of the same base");
+
+  // x ^ 2 is positive for negative x too, so its square root must stay
+  Expression<T> root {Expression<T>::fromString("(x ^ 2) ^ 0.5")};
+
+  printResult<T>(root.simplify().evaluate({{"x", -2}}) == 2 &&
+                 root.derivative("x").simplify().evaluate({{"x", -2}}) == -1,
+                 "Simplify keeps fractional powers of powers");
+
+  printResult<T>(simplified("sin(0 + x) + 2 * sin(x)") ==
+                 simplified("3 * sin(x)"),
+                 "Simplify inside function arguments");
+
+  printResult<T>(simplified("x * 3 + x * 2").simplify() ==
+                 simplified("x * 3 + x * 2"),
+                 "Simplify is idempotent");
+
+  // (-1) ^ 0.5 is NaN, which has to survive as a constant
+  Expression<T> undefined {simplified("x + (0 - 1) ^ 0.5")};
+  Expression<T> nan {std::numeric_limits<T>::quiet_NaN()};
+  std::size_t poolSize {nan.pool()->size()};
+  Expression<T> negativeNan {-std::numeric_limits<T>::quiet_NaN()};
+
+  printResult<T>(negativeNan == nan && nan.pool()->size() == poolSize,
+                 "Every NaN shares one node");
+
+  printResult<T>(std::isnan(undefined.evaluate({{"x", 1}})) &&
+                 simplified("(0 - 1) ^ 0.5 * y + x + (0 - 1) ^ 0.5") ==
+                   simplified("x + (0 - 1) ^ 0.5 * y + (0 - 1) ^ 0.5"),
+                 "Simplify keeps NaN constants");
+
+  bool smaller {true};
+
+  for (const char *exprString : {"(x ^ x) ^ (x ^ x)", "ln(x) / cos(x)"}) {
+    Expression<T> result {Expression<T>::fromString(exprString)};
+
+    for (int order {0}; order < 2; ++order) {
+      result = result.derivative("x");
+      smaller &= result.simplify().nodeCount() < result.nodeCount();
+      result = result.simplify();
+    }
+  }
+
+  printResult<T>(smaller, "Simplify shrinks repeated derivatives");
+}
+
+template <typename T>
+void tests::sharing() {
+  Expression<T> expr1 {Expression<T>::fromString("sin(x) * y + sin(x) * y")};
+  printResult<T>(expr1.nodeCount() == 9 && expr1.uniqueNodeCount() == 5,
+                 "Identical subtrees share one node");
+
+  printResult<T>(Expression<T>::fromString("sin(x) * y") ==
+                 Expression<T>::sin(Expression<T>("x")) * Expression<T>("y"),
+                 "Equality of separately built expressions");
+
+  Expression<T> expr2 {Expression<T>("x")};
+  for (int depth {0}; depth < 20; ++depth) expr2 = expr2 * expr2;
+
+  Expression<T> result {expr2.derivative("x")};
+  printResult<T>(result.uniqueNodeCount() < 100 && result.nodeCount() > 1000000,
+                 "Derivative preserves sharing");
+
+  // x ^ 2^20 and its derivative 2^20 * x ^ (2^20 - 1) at x = 1
+  CompiledExpression<T> program {result.compile()};
+  printResult<T>(expr2.compile().size() == 21 &&
+                 program.size() <= result.uniqueNodeCount() &&
+                 program.evaluate(std::vector<T> {1}) == T(1048576) &&
+                 result.evaluate({{"x", 1}}) == T(1048576),
+                 "Compile and evaluate each shared node once");
+}
+
+template <typename T>
+void tests::gradient() {
+  std::map<std::string, T> context {{"x", T(1.5)}, {"y", T(0.5)}};
+  bool matches {true};
+
+  for (const char *exprString :
+       {"x * sin(y) + ln(x) / y", "exp(x * y) - x ^ 3", "x ^ y",
+        "cos(x / y) * (x - y) * x"}) {
+    Expression<T> expr {Expression<T>::fromString(exprString)};
+    Gradient<T> gradient {expr.gradient(context)};
+
+    matches &= gradient.value == expr.evaluate(context);
+
+    for (const auto &var : context) {
+      T symbolic {expr.derivative(var.first).simplify().evaluate(context)},
+        numeric {gradient.partials[var.first]};
+
+      matches &= std::abs(symbolic - numeric) <=
+                 T(1e-4) * (T(1) + std::abs(symbolic));
+    }
+  }
+
+  printResult<T>(matches, "Gradient matches symbolic derivatives");
+
+  // The base's partial is 0 ^ -1 times a zero exponent here
+  Gradient<T> constantPower {
+    Expression<T>::fromString("(x - 1) ^ 0 + x").gradient({{"x", T(1)}})
+  };
+  printResult<T>(constantPower.partials["x"] == T(1),
+                 "Gradient of a zero power of a zero base");
+
+  // ln(-2) is undefined, as it is for the symbolic derivative by y
+  Gradient<T> negativeBase {
+    Expression<T>::fromString("x ^ y").gradient({{"x", T(-2)}, {"y", T(2)}})
+  };
+  bool threw {false};
+  try {
+    Expression<T>::fromString("x ^ y").derivative("y").evaluate(
+      {{"x", T(-2)}, {"y", T(2)}}
+    );
+  } catch (const std::runtime_error &) { threw = true; }
+  printResult<T>(negativeBase.value == T(4) &&
+                 negativeBase.partials["x"] == T(-4) &&
+                 std::isnan(negativeBase.partials["y"]) && threw,
+                 "Gradient by the exponent of a negative base is NaN");
+}
+
+template <typename T>
+void tests::staticExpressions() {
+  using namespace static_expr;
+
+  constexpr Variable<0> x {};
+  constexpr Variable<1> y {};
+
+  const std::vector<std::string> names {"x", "y"};
+  const T slots[] {T(1.5), T(0.5)};
+  std::map<std::string, T> context {{"x", slots[0]}, {"y", slots[1]}};
+
+  bool matches {true};
+
+  auto check = [&](T value, const Expression<T> &runtime) {
+    T expected {runtime.evaluate(context)};
+    matches &= std::abs(value - expected) <=
+               T(1e-4) * (T(1) + std::abs(expected));
+  };
+
+  auto compareDerivatives = [&](const Expression<T> &runtime, T dx, T dy) {
+    check(dx, runtime.derivative("x"));
+    check(dy, runtime.derivative("y"));
+  };
+
+  auto f1 = x * sin(y) + ln(x) / y;
+  auto f2 = exp(x * y) - (x ^ Integer<3> {});
+  auto f3 = x ^ y;
+  auto f4 = cos(x / y) * (x - y) * x * 2.5;
+
+  compareDerivatives(toExpression<T>(f1, names),
+                     derivative(f1, x).evaluate(slots),
+                     derivative(f1, y).evaluate(slots));
+  compareDerivatives(toExpression<T>(f2, names),
+                     derivative(f2, x).evaluate(slots),
+                     derivative(f2, y).evaluate(slots));
+  compareDerivatives(toExpression<T>(f3, names),
+                     derivative(f3, x).evaluate(slots),
+                     derivative(f3, y).evaluate(slots));
+  compareDerivatives(toExpression<T>(f4, names),
+                     derivative<decltype(x)>(f4).evaluate(slots),
+                     derivative<decltype(y)>(f4).evaluate(slots));
+
+  printResult<T>(matches, "Static derivatives match runtime ones");
+
+  printResult<T>(toExpression<T>(f1, names) ==
+                 Expression<T>::fromString("x * sin(y) + ln(x) / y"),
+                 "Static expression converts to runtime");
+
+  // Simplified while the types are built
+  printResult<T>(
+    std::is_same<decltype(derivative(x * Integer<3> {}, x)),
+                 Integer<3>>::value &&
+    std::is_same<decltype(derivative(sin(y), x)), Integer<0>>::value &&
+    std::is_same<decltype(derivative(x ^ Integer<2> {}, x)),
+                 Binary<'*', Integer<2>, Variable<0>>>::value,
+    "Static derivative simplifies at compile time");
+}
+
+template <typename T>
+void tests::pools() {
+  std::weak_ptr<ExpressionPool<T>> released;
+
+  {
+    Expression<T> unscoped {Expression<T>::fromString("sin(x) * x")};
+    released = unscoped.derivative("x").simplify().pool();
+  }
+
+  printResult<T>(released.expired(),
+                 "Default pool is freed with its last expression");
+
+  Expression<T> outside {Expression<T>("x") * Expression<T>(2)};
+
+  {
+    typename ExpressionPool<T>::Scope scope;
+
+    Expression<T> expr {Expression<T>::fromString("ln(x) / cos(x)")};
+    Expression<T> result {expr.derivative("x").simplify()};
+    released = result.pool();
+
+    printResult<T>(result.pool() != outside.pool() &&
+                   result.pool()->size() >= result.uniqueNodeCount(),
+                   "Derivation is built in the scoped pool");
+
+    printResult<T>(expr + outside == Expression<T>::fromString(
+                     "ln(x) / cos(x) + x * 2"),
+                   "Operators across pools");
+  }
+
+  printResult<T>(released.expired(), "Scoped pool is freed at once");
+  printResult<T>(sizeof(typename ExpressionPool<T>::Node) <= 24,
+                 "Compact node layout");
+}
+
+template <typename T>
+void tests::lruCache() {
+  LruCache<std::string, T> cache {2};
+
+  *cache.get("x") = T(1);
+  *cache.get("y") = T(2);
+
+  printResult<T>(*cache.get("x") == T(1) && cache.hits() == 1 &&
+                 cache.misses() == 2,
+                 "Cache hit returns the stored entry");
+
+  // "x" is used after "y", so "z" pushes "y" out. Holders of an evicted
+  // entry keep it alive
+  std::shared_ptr<T> evicted {cache.get("y")};
+  cache.get("x");
+  cache.get("z");
+
+  printResult<T>(cache.size() == 2 && cache.evictions() == 1 &&
+                 *cache.get("x") == T(1) && *evicted == T(2) &&
+                 *cache.get("y") == T(0),
+                 "Cache evicts the least recently used entry");
+}
+
+template <typename T>
+void tests::server() {
+  Server server {1, 16};
+
+  std::string error {server.handle("simplify x / 0")};
+  printResult<T>(error.compare(0, 7, "error: ") == 0 &&
+                 error.find_first_of("\r\n") == std::string::npos,
+                 "Server error response is a single line");
+
+  // Every request gets exactly one response line
+  int input[2], output[2];
+  std::string requests {"simplify x / 0\neval x=1 x\ndiff x x/0\nstats\n"};
+  bool piped {pipe(input) == 0 && pipe(output) == 0 &&
+              write(input[1], requests.data(), requests.size()) ==
+                static_cast<ssize_t>(requests.size())};
+
+  std::string responses;
+
+  if (piped) {
+    close(input[1]);
+    server.session(input[0], output[1]);
+    close(input[0]);
+    close(output[1]);
+
+    char buffer[4096];
+    ssize_t count;
+
+    while ((count = read(output[0], buffer, sizeof(buffer))) > 0)
+      responses.append(buffer, static_cast<std::size_t>(count));
+
+    close(output[0]);
+  }
+
+  printResult<T>(std::count(responses.begin(), responses.end(), '\n') == 4 &&
+                 responses.compare(0, 7, "error: ") == 0,
+                 "Server session answers each request with one line");
+
+  // Stopping a listening server still answers the requests already sent
+  std::string path {"/tmp/differentiator-test-" + std::to_string(getpid()) +
+                    ".sock"};
+  bool listened {true};
+
+  std::thread listener([&]() {
+    try {
+      server.listen(path);
+    } catch (const std::exception &) {
+      listened = false;
+    }
+  });
+
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  int client {socket(AF_UNIX, SOCK_STREAM, 0)};
+  bool connected {false};
+
+  for (int attempt {0}; attempt < 1000 && !connected; ++attempt) {
+    connected = connect(client, reinterpret_cast<const sockaddr *>(&address),
+                        sizeof(address)) == 0;
+    if (!connected) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::string slow {"simplify x"};
+  for (int term {1}; term < 20000; ++term)
+    slow += " + " + std::to_string(term % 7 + 1) + " * x ^ " +
+            std::to_string(term % 3 + 1);
+
+  auto send = [client](const std::string &data) {
+    for (std::size_t sent {0}; sent < data.size();) {
+      ssize_t count {write(client, data.data() + sent, data.size() - sent)};
+      if (count <= 0) return false;
+      sent += static_cast<std::size_t>(count);
+    }
+
+    return true;
+  };
+
+  responses.clear();
+
+  if (connected) {
+    // The first answer means the session is running, so the signal reaches
+    // the server's handler. The slow request is still being worked on
+    std::string first {"eval x=1 1+1\n"};
+    char buffer[4096];
+    ssize_t count {0};
+
+    if (send(first))
+      count = read(client, buffer, sizeof(buffer));
+
+    if (count > 0 && send(slow + "\n")) {
+      responses.assign(buffer, static_cast<std::size_t>(count));
+      kill(getpid(), SIGTERM);
+
+      while ((count = read(client, buffer, sizeof(buffer))) > 0)
+        responses.append(buffer, static_cast<std::size_t>(count));
+    } else {
+      kill(getpid(), SIGTERM);
+    }
+  }
+
+  close(client);
+  listener.join();
+
+  printResult<T>(listened && responses ==
+                   "2\n" + server.handle(slow) + "\n" &&
+                 access(path.c_str(), F_OK) != 0,
+                 "Server stop answers pending requests, removes the socket");
+}
+
 template <typename T>
 void tests::toString() {
   Expression<T> expr1 {Expression<T>("x") + Expression<T>(2)};
@@ -101,10 +674,21 @@ void tests::all() {
   constructors<T>();
   operators<T>();
   mathFunctions<T>();
+  parsing<T>();
+  deepExpressions<T>();
   substitution<T>();
   evaluation<T>();
+  compilation<T>();
+  batchEvaluation<T>();
   toString<T>();
   derivative<T>();
+  simplification<T>();
+  sharing<T>();
+  gradient<T>();
+  staticExpressions<T>();
+  pools<T>();
+  lruCache<T>();
+  server<T>();
 
   std::cout << "All tests finished!\n";
 }
@@ -0,0 +1,64 @@
+#ifndef THREAD_POOL_TPP
+#define THREAD_POOL_TPP
+
+#include "../include/thread_pool.hpp"
+#include <memory>
+
+inline ThreadPool::ThreadPool(std::size_t threads) : m_stopping {false} {
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+
+  for (std::size_t i {0}; i < threads; ++i)
+    m_workers.emplace_back(&ThreadPool::work, this);
+}
+
+inline ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock {m_mutex};
+    m_stopping = true;
+  }
+
+  m_ready.notify_all();
+
+  for (std::thread &worker : m_workers) worker.join();
+}
+
+template <typename F>
+std::future<typename std::result_of<F()>::type> ThreadPool::submit(F task) {
+  using Result = typename std::result_of<F()>::type;
+
+  // std::function needs a copyable target, packaged_task is move-only
+  auto packaged {std::make_shared<std::packaged_task<Result()>>(task)};
+  std::future<Result> result {packaged->get_future()};
+
+  {
+    std::lock_guard<std::mutex> lock {m_mutex};
+    m_tasks.push([packaged]() { (*packaged)(); });
+  }
+
+  m_ready.notify_one();
+
+  return result;
+}
+
+inline std::size_t ThreadPool::size() const { return m_workers.size(); }
+
+inline void ThreadPool::work() {
+  while (true) {
+    std::function<void()> task;
+
+    {
+      std::unique_lock<std::mutex> lock {m_mutex};
+      m_ready.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+
+      if (m_tasks.empty()) return;
+
+      task = std::move(m_tasks.front());
+      m_tasks.pop();
+    }
+
+    task();
+  }
+}
+
+#endif // THREAD_POOL_TPP
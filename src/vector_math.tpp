@@ -0,0 +1,195 @@
+#ifndef VECTOR_MATH_TPP
+#define VECTOR_MATH_TPP
+
+#include "../include/vector_math.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace vector_math {
+template <typename T>
+void exp(const T *__restrict in, T *__restrict out, std::size_t count) {
+  for (std::size_t i {0}; i < count; ++i) out[i] = std::exp(in[i]);
+}
+
+template <typename T>
+void log(const T *__restrict in, T *__restrict out, std::size_t count) {
+  for (std::size_t i {0}; i < count; ++i) out[i] = std::log(in[i]);
+}
+
+template <typename T>
+void sin(const T *__restrict in, T *__restrict out, std::size_t count) {
+  for (std::size_t i {0}; i < count; ++i) out[i] = std::sin(in[i]);
+}
+
+template <typename T>
+void cos(const T *__restrict in, T *__restrict out, std::size_t count) {
+  for (std::size_t i {0}; i < count; ++i) out[i] = std::cos(in[i]);
+}
+
+namespace detail {
+// Adding Magic rounds a double below 2^51 in magnitude to an integer, which
+// then sits in the low bits of the sum
+const double Magic {6755399441055744.0}; // 1.5 * 2^52
+const double Two52 {4503599627370496.0};
+const double NaN {std::numeric_limits<double>::quiet_NaN()};
+
+// Compile to plain register moves, which keeps the loops vectorizable
+inline std::uint64_t bits(double x) {
+  std::uint64_t u;
+  std::memcpy(&u, &x, sizeof u);
+
+  return u;
+}
+
+inline double fromBits(std::uint64_t u) {
+  double x;
+  std::memcpy(&x, &u, sizeof x);
+
+  return x;
+}
+
+// exp(x) for x in [-708, 709]: x = n * ln(2) + r with |r| <= ln(2) / 2,
+// exp(r) from its Taylor series to r^13, 2^n built in the exponent bits
+__attribute__((always_inline)) inline double expCore(double x) {
+  const double Log2e {1.44269504088896338700e+00},
+    Ln2Hi {6.93147180369123816490e-01}, Ln2Lo {1.90821492927058770002e-10};
+
+  double t {x * Log2e + Magic}, n {t - Magic};
+  double r {(x - n * Ln2Hi) - n * Ln2Lo};
+
+  // Estrin's scheme: a shallow tree of independent products instead of one
+  // long Horner chain, so consecutive rows overlap in the pipeline
+  const double E2 {1.0 / 2}, E3 {1.0 / 6}, E4 {1.0 / 24}, E5 {1.0 / 120},
+    E6 {1.0 / 720}, E7 {1.0 / 5040}, E8 {1.0 / 40320}, E9 {1.0 / 362880},
+    E10 {1.0 / 3628800}, E11 {1.0 / 39916800}, E12 {1.0 / 479001600},
+    E13 {1.0 / 6227020800};
+
+  double r2 {r * r}, r4 {r2 * r2}, r8 {r4 * r4};
+  double p {((1.0 + r) + (E2 + E3 * r) * r2) +
+            ((E4 + E5 * r) + (E6 + E7 * r) * r2) * r4 +
+            (((E8 + E9 * r) + (E10 + E11 * r) * r2) + (E12 + E13 * r) * r4) *
+              r8};
+
+  return p * fromBits((bits(t) - bits(Magic) + 1023) << 52);
+}
+
+// ln(x) for normal, positive, finite x: x = 2^e * (1 + f) with 1 + f in
+// [sqrt(2) / 2, sqrt(2)), ln(1 + f) = 2 * atanh(f / (2 + f)) with fdlibm's
+// minimax coefficients
+__attribute__((always_inline)) inline double logCore(double x) {
+  const double Ln2Hi {6.93147180369123816490e-01},
+    Ln2Lo {1.90821492927058770002e-10}, Sqrt2 {1.41421356237309504880},
+    Lg1 {6.666666666666735130e-01}, Lg2 {3.999999999940941908e-01},
+    Lg3 {2.857142874366239149e-01}, Lg4 {2.222219843214978396e-01},
+    Lg5 {1.818357216161805012e-01}, Lg6 {1.531383769920937332e-01},
+    Lg7 {1.479819860511658591e-01};
+
+  std::uint64_t u {bits(x)};
+  double m {fromBits((u & 0x000fffffffffffffull) | 0x3ff0000000000000ull)};
+  // The biased exponent turned into a double without an integer conversion
+  double e {fromBits((u >> 52) | 0x4330000000000000ull) - Two52 - 1023.0};
+
+  bool high {m > Sqrt2};
+  m = high ? m * 0.5 : m;
+  e = high ? e + 1.0 : e;
+
+  double f {m - 1.0}, s {f / (2.0 + f)}, z {s * s}, w {z * z};
+  double r {z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7))) +
+            w * (Lg2 + w * (Lg4 + w * Lg6))};
+  double halfSquare {0.5 * f * f};
+
+  return e * Ln2Hi - ((halfSquare - (s * (halfSquare + r) + e * Ln2Lo)) - f);
+}
+
+// sin(x + offset * pi / 2) for 0 < |x| <= 1e6, zeros would lose their sign:
+// x = n * pi / 2 + r with |r| <= pi / 4, pi / 2 split into 33 bit parts so n
+// times each is exact. The quadrant picks the sine or cosine polynomial and
+// the sign
+__attribute__((always_inline)) inline double sinCore(double x,
+                                                     std::uint64_t offset) {
+  const double TwoOverPi {6.36619772367581382433e-01},
+    Pio2_1 {1.57079632673412561417e+00}, Pio2_2 {6.07710050630396597660e-11},
+    Pio2_3 {2.02226624871116645580e-21}, Pio2_3t {8.47842766036889956997e-32},
+    S1 {-1.66666666666666324348e-01}, S2 {8.33333333332248946124e-03},
+    S3 {-1.98412698298579493134e-04}, S4 {2.75573137070700676789e-06},
+    S5 {-2.50507602534068634195e-08}, S6 {1.58969099521155010221e-10},
+    C1 {4.16666666666666019037e-02}, C2 {-1.38888888888741095749e-03},
+    C3 {2.48015872894767294178e-05}, C4 {-2.75573143513906633035e-07},
+    C5 {2.08757232129817482790e-09}, C6 {-1.13596475577881948265e-11};
+
+  double t {x * TwoOverPi + Magic}, n {t - Magic};
+  double r {(((x - n * Pio2_1) - n * Pio2_2) - n * Pio2_3) - n * Pio2_3t};
+  double z {r * r}, z2 {z * z}, z4 {z2 * z2};
+
+  // Estrin's scheme, as in expCore()
+  double sine {r + r * z * ((S1 + S2 * z) + (S3 + S4 * z) * z2 +
+                            (S5 + S6 * z) * z4)};
+  double cosine {1.0 - 0.5 * z + z2 * ((C1 + C2 * z) + (C3 + C4 * z) * z2 +
+                                       (C5 + C6 * z) * z4)};
+
+  // Magic's low bits are zero, so these are the quadrant's
+  std::uint64_t quadrant {bits(t) + offset};
+  std::uint64_t odd {0 - (quadrant & 1)};
+
+  return fromBits(((bits(cosine) & odd) | (bits(sine) & ~odd)) ^
+                  ((quadrant & 2) << 62));
+}
+
+inline void sinCos(const double *__restrict in, double *__restrict out,
+                   std::size_t count, std::uint64_t offset) {
+  for (std::size_t i {0}; i < count; ++i) {
+    double value {sinCore(in[i], offset)};
+    out[i] = std::abs(in[i]) <= 1e6 && in[i] != 0 ? value : NaN;
+  }
+}
+} // namespace detail
+
+// Every kernel leaves NaN in the rows it does not cover. None of them ever
+// yields NaN for a row it does cover, so those are the rows to patch
+
+inline void exp(const double *__restrict in, double *__restrict out,
+                std::size_t count) {
+  for (std::size_t i {0}; i < count; ++i) {
+    double value {detail::expCore(in[i])};
+    out[i] = in[i] >= -708.0 && in[i] <= 709.0 ? value : detail::NaN;
+  }
+
+  for (std::size_t i {0}; i < count; ++i)
+    if (out[i] != out[i]) out[i] = std::exp(in[i]);
+}
+
+inline void log(const double *__restrict in, double *__restrict out,
+                std::size_t count) {
+  const double Min {std::numeric_limits<double>::min()},
+    Max {std::numeric_limits<double>::max()};
+
+  for (std::size_t i {0}; i < count; ++i) {
+    double value {detail::logCore(in[i])};
+    out[i] = in[i] >= Min && in[i] <= Max ? value : detail::NaN;
+  }
+
+  for (std::size_t i {0}; i < count; ++i)
+    if (out[i] != out[i]) out[i] = std::log(in[i]);
+}
+
+inline void sin(const double *__restrict in, double *__restrict out,
+                std::size_t count) {
+  detail::sinCos(in, out, count, 0);
+
+  for (std::size_t i {0}; i < count; ++i)
+    if (out[i] != out[i]) out[i] = std::sin(in[i]);
+}
+
+inline void cos(const double *__restrict in, double *__restrict out,
+                std::size_t count) {
+  detail::sinCos(in, out, count, 1);
+
+  for (std::size_t i {0}; i < count; ++i)
+    if (out[i] != out[i]) out[i] = std::cos(in[i]);
+}
+
+} // namespace vector_math
+
+#endif // VECTOR_MATH_TPP